@@ -14,9 +14,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include "util.h"
 #include "rwpar.h"
 #include "fileops.h"
+#include "md5mb.h"
+#include "pool.h"
 #include "rs.h"
 #include "readoldpar.h"
 #include "backend.h"
@@ -143,19 +146,34 @@ int
 hash_file(hfile_t *file, char type)
 {
 	i64 s;
-	u8 buf[16384];
+	u8 *buf;
 
 	if (type < HASH16K) return 1;
+	/*\ Both hashes wanted: get them in one go \*/
+	if ((type >= HASH) && (file->hashed < HASH16K)) {
+		s = file_md5(file->filename, file->hash,
+				file->hash_16k, &file->magic);
+		if (s >= 0) {
+			file->hashed = HASH;
+			if (!file->file_size)
+				file->file_size = s;
+			return 1;
+		}
+	}
 	if (file->hashed < HASH16K) {
+		buf = file_buf(16384);
 		if (!file_md5_buffer(file->filename, file->hash_16k,
-					buf, sizeof(buf)))
+					buf, 16384)) {
+			free(buf);
 			return 0;
+		}
 		file->hashed = HASH16K;
 		COPY(&file->magic, buf, 1);
+		free(buf);
 	}
 	if (type < HASH) return 1;
 	if (file->hashed < HASH) {
-		s = file_md5(file->filename, file->hash);
+		s = file_md5(file->filename, file->hash, 0, 0);
 		if (s >= 0) {
 			file->hashed = HASH;
 			if (!file->file_size)
@@ -165,6 +183,188 @@ hash_file(hfile_t *file, char type)
 	return 1;
 }
 
+/*\ Files hashed at the same time on one device \*/
+#define DEV_FILES 64
+
+/*\ Files on one device, in the order list of hash_files() \*/
+struct hdev {
+	i64 dev;
+	int lo, hi;	/*\ Range in the order list \*/
+	int next;	/*\ First one not taken yet \*/
+};
+
+struct hjob {
+	file_t *f;
+	md5 *hash;
+	md5 *hash_16k;
+	i64 *magic;
+	i64 *size;
+	int *ord;
+	struct hdev *dev;
+	int *wdev;	/*\ Device of every worker \*/
+	int batch;
+	pthread_mutex_t lock;
+};
+
+static int
+dev_cmp(const void *a, const void *b)
+{
+	const struct hdev *x = a, *y = b;
+
+	if (x->dev != y->dev)
+		return (x->dev < y->dev) ? -1 : 1;
+	return x->lo - y->lo;
+}
+
+/*\ Keep taking a batch of files from one device and hash them \*/
+static void
+hash_worker(void *arg, int w)
+{
+	struct hjob *h = arg;
+	struct hdev *d = h->dev + h->wdev[w];
+	file_t f[MD5MB_MAX];
+	md5 hash[MD5MB_MAX], hash_16k[MD5MB_MAX];
+	i64 magic[MD5MB_MAX], size[MD5MB_MAX];
+	int i, k, lo, o;
+
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		lo = d->next;
+		k = d->hi - lo;
+		if (k > h->batch)
+			k = h->batch;
+		if (k > 0)
+			d->next += k;
+		pthread_mutex_unlock(&h->lock);
+		if (k <= 0)
+			break;
+		for (i = 0; i < k; i++)
+			f[i] = h->f[h->ord[lo + i]];
+		file_md5_many(f, hash, hash_16k, magic, size, k);
+		for (i = 0; i < k; i++) {
+			o = h->ord[lo + i];
+			COPY(h->hash[o], hash[i], sizeof(md5));
+			COPY(h->hash_16k[o], hash_16k[i], sizeof(md5));
+			h->magic[o] = magic[i];
+			h->size[o] = size[i];
+		}
+	}
+}
+
+/*\
+|*| Calculate md5 sums for a number of files at once.
+|*|  Every device gets its own workers, so a set spread over several
+|*|  disks is read from all of them at once, but no disk has more than
+|*|  DEV_FILES files (one batch with --io=hdd) being read at a time.
+|*|  Files that fail are left alone; hash_file() will complain later.
+\*/
+void
+hash_files(hfile_t **files, int n)
+{
+	hfile_t **todo;
+	struct hdev *d;
+	struct hjob h;
+	int i, j, m, nd, nw, w;
+
+	NEW(todo, n);
+	for (i = m = 0; i < n; i++)
+		if (files[i] && (files[i]->hashed < HASH))
+			todo[m++] = files[i];
+	if (!m) {
+		free(todo);
+		return;
+	}
+	NEW(h.f, m);
+	NEW(h.hash, m);
+	NEW(h.hash_16k, m);
+	NEW(h.magic, m);
+	NEW(h.size, m);
+	NEW(h.ord, m);
+	NEW(d, m);
+	for (i = 0; i < m; i++) {
+		h.f[i] = file_open(todo[i]->filename, 0);
+		h.size[i] = -1;
+		d[i].dev = file_dev(h.f[i]);
+		d[i].lo = i;
+	}
+	/*\ Sort by device, and make one entry per device \*/
+	qsort(d, m, sizeof(*d), dev_cmp);
+	for (i = nd = 0; i < m; i = j) {
+		for (j = i; (j < m) && (d[j].dev == d[i].dev); j++)
+			h.ord[j] = d[j].lo;
+		d[nd].dev = d[i].dev;
+		d[nd].lo = d[nd].next = i;
+		d[nd].hi = j;
+		nd++;
+	}
+	h.dev = d;
+	h.batch = md5mb_lanes();
+	NEW(h.wdev, nd * DEV_FILES);
+	for (i = nw = 0; i < nd; i++) {
+		w = (d[i].hi - d[i].lo + h.batch - 1) / h.batch;
+		if (w > DEV_FILES / h.batch)
+			w = DEV_FILES / h.batch;
+		if (cmd.hdd || (w < 1))
+			w = 1;
+		while (w-- > 0)
+			h.wdev[nw++] = i;
+	}
+	pthread_mutex_init(&h.lock, 0);
+	pool_spawn(hash_worker, &h, nw);
+	pthread_mutex_destroy(&h.lock);
+
+	for (i = 0; i < m; i++) {
+		file_close(h.f[i]);
+		if (h.size[i] < 0)
+			continue;
+		COPY(todo[i]->hash, h.hash[i], sizeof(md5));
+		if (todo[i]->hashed < HASH16K) {
+			COPY(todo[i]->hash_16k, h.hash_16k[i], sizeof(md5));
+			todo[i]->magic = h.magic[i];
+		}
+		todo[i]->hashed = HASH;
+		if (!todo[i]->file_size)
+			todo[i]->file_size = h.size[i];
+	}
+	free(h.f);
+	free(h.hash);
+	free(h.hash_16k);
+	free(h.magic);
+	free(h.size);
+	free(h.ord);
+	free(h.wdev);
+	free(d);
+	free(todo);
+}
+
+/*\
+|*| Hash all files that have the name of one of the files in the list,
+|*|  so find_file() doesn't have to do them one by one.
+\*/
+void
+hash_names(pfile_t *files)
+{
+	hfile_t *p, **list;
+	pfile_t *q;
+	int n;
+
+	for (n = 0, p = hfile; p; p = p->next)
+		n++;
+	if (!n)
+		return;
+	NEW(list, n);
+	for (n = 0, p = hfile; p; p = p->next) {
+		for (q = files; q; q = q->next)
+			if (!q->match && (unicode_cmp(p->filename,
+							q->filename) >= 0))
+				break;
+		if (q)
+			list[n++] = p;
+	}
+	hash_files(list, n);
+	free(list);
+}
+
 /*\
 |*| Rename a file so it's not in the way
 |*|  Append '.bad' because I assume a file that's in the way
@@ -296,6 +496,53 @@ find_file(pfile_t *file, int displ)
 	return (file->match != 0);
 }
 
+/*\
+|*| Find a copy of a file that was cut short:
+|*|  Same name, shorter, but with the same 16k hash.
+\*/
+hfile_t *
+find_partial(u16 *path, pfile_t *file)
+{
+	hfile_t *p;
+
+	if (file->file_size <= 16384)
+		return 0;
+	for (p = hfile; p; p = p->next) {
+		if (unicode_cmp(p->filename, path) < 0)
+			continue;
+		if (!hash_file(p, HASH))
+			continue;
+		if ((p->file_size < 16384) ||
+				(p->file_size >= file->file_size))
+			continue;
+		if (CMP_MD5(p->hash_16k, file->hash_16k))
+			return p;
+	}
+	return 0;
+}
+
+/*\
+|*| Find a damaged copy of a file:
+|*|  Same name, same size, but a different md5 hash.
+\*/
+hfile_t *
+find_damaged(u16 *path, pfile_t *file)
+{
+	hfile_t *p;
+
+	for (p = hfile; p; p = p->next) {
+		if (unicode_cmp(p->filename, path) < 0)
+			continue;
+		if (!hash_file(p, HASH))
+			continue;
+		if (p->file_size != file->file_size)
+			continue;
+		if (!CMP_MD5(p->hash, file->hash))
+			return p;
+	}
+	return 0;
+}
+
 /*\
 |*| Find a file in the static directory structure
 \*/
@@ -453,7 +700,7 @@ par_control_check(par_t *par)
 	if (!cmd.ctrl) return 1;
 
 	/*\ Check version number \*/
-	if (par->version > 0x0001ffff) {
+	if (par->version > 0x0002ffff) {
 		fprintf(stderr, "%s: PAR Version mismatch! (%x.%x)\n",
 				basename(par->filename), par->version >> 16,
 				(par->version & 0xffff) >> 8);
@@ -485,7 +732,7 @@ find_volumes(par_t *par, int tofind)
 	par_t *tmp;
 
 	v = 0;
-	if (par->vol_number) {
+	if (par->vol_number && par->f) {
 		CNEW(v, 1);
 		v->match = find_file_name(par->filename, 1);
 		v->vol_number = par->vol_number;
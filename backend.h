@@ -29,7 +29,11 @@ int unicode_gt(u16 *a, u16 *b);
 hfile_t * hfile_add(u16 *filename);
 void hash_directory(char *dir);
 int hash_file(hfile_t *file, char type);
+void hash_files(hfile_t **files, int n);
+void hash_names(pfile_t *files);
 int find_file(pfile_t *file, int displ);
+hfile_t * find_partial(u16 *path, pfile_t *file);
+hfile_t * find_damaged(u16 *path, pfile_t *file);
 hfile_t * find_file_name(u16 *path, int displ);
 hfile_t * find_volume(u16 *name, i64 vol);
 int move_away(u16 *file, const u8 *ext);
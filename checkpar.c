@@ -26,12 +26,13 @@
 int
 check_par(par_t *par)
 {
-	int m;
+	int m, d;
 	pfile_t *p;
 	u16 *str;
 	sub_t *sub = 0;
 
 	/*\ Look for all the data files \*/
+	hash_names(par->files);
 	for (m = 0, p = par->files; p; p = p->next) {
 		if (!find_file(p, 1) && USE_FILE(p))
 			m++;
@@ -48,6 +49,22 @@ check_par(par_t *par)
 			rename_away(p->match->filename, str);
 		}
 	}
+	/*\ Damaged files can be fixed in place, if nothing is missing \*/
+	if (m && cmd.repair && (cmd.action != ACTION_CHECK)) {
+		for (d = 0, p = par->files; p; p = p->next)
+			if (!p->match && USE_FILE(p) &&
+			    find_damaged(do_sub(p->filename, sub), p))
+				d++;
+		if ((d == m) && (cmd.action != ACTION_MIX))
+			find_volumes(par, d + 1);
+		if ((d == m) && par->volumes) {
+			fprintf(stderr, "\nRepairing:\n");
+			repair_files(par->files, par->volumes, sub);
+			for (m = 0, p = par->files; p; p = p->next)
+				if (!find_file(p, 0) && USE_FILE(p))
+					m++;
+		}
+	}
 	if (m == 0) {
 		fprintf(stderr, "All files found\n");
 		free_sub(sub);
@@ -64,7 +81,10 @@ check_par(par_t *par)
 	}
 	if (cmd.action != ACTION_CHECK) {
 		fprintf(stderr, "\nRestoring:\n");
-		m = restore_files(par->files, par->volumes, sub);
+		if (cmd.action == ACTION_MIX)
+			m = restore_sets(par->files, par->volumes, sub);
+		else
+			m = restore_files(par->files, par->volumes, sub);
 		free_sub(sub);
 		return m;
 	}
@@ -7,6 +7,7 @@
 |*|   going to cause the most portability problems.
 \*/
 
+#define _GNU_SOURCE	/*\ For O_DIRECT \*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -16,8 +17,17 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 #include <errno.h>
+#include <pthread.h>
 #include "md5.h"
+#include "md5mb.h"
 #include "fileops.h"
 #include "util.h"
 #include "par.h"
@@ -155,66 +165,249 @@ file_rename(u16 *src, u16 *dst)
 	return i;
 }
 
+/*\
+|*| Open files.
+|*|  All reads and writes give their own offset, so any number of
+|*|  threads can use the same file at once.  Read-only files are kept
+|*|  open, up to a budget that follows from RLIMIT_NOFILE.  Beyond that,
+|*|  the least recently used one that isn't being used is closed, and
+|*|  opened again when it's needed.
+|*| With --direct, big reads and writes bypass the page cache, so a
+|*|  run over a huge set doesn't push everything else out of memory.
+|*|  Each file gets a second descriptor opened with O_DIRECT, used
+|*|  when buffer, offset and length are all aligned.  Everything else
+|*|  goes through the cache, which is told to drop it again afterwards.
+\*/
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+/*\ Alignment needed for O_DIRECT on any disk we're likely to see \*/
+#define DIRECT_ALIGN 0x1000
+
+/*\ Read-only files that are open, most recently used first,
+|*|  and the lock for that list and everything else about open files.
+\*/
+static file_t lru_head = 0, lru_tail = 0;
+static pthread_mutex_t openlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*\ Descriptors in use, and how many we allow ourselves \*/
+static int nopen = 0, budget = 0;
+static long fd_hits = 0, fd_misses = 0, fd_closed = 0;
+
+/*\ Leave some descriptors for everything else \*/
+#define FD_SPARE 32
+
+/*\ Remove a file from the list.  Called with the lock held. \*/
+static void
+lru_unlink(file_t f)
+{
+	if (f->prev) f->prev->next = f->next;
+	else if (lru_head == f) lru_head = f->next;
+	else return;
+	if (f->next) f->next->prev = f->prev;
+	else lru_tail = f->prev;
+	f->next = f->prev = 0;
+}
+
+/*\ Put a file at the front of the list \*/
+static void
+lru_touch(file_t f)
+{
+	if (lru_head == f)
+		return;
+	lru_unlink(f);
+	f->next = lru_head;
+	if (lru_head) lru_head->prev = f;
+	else lru_tail = f;
+	lru_head = f;
+}
+
 static int
-do_seek(file_t f)
+fd_budget(void)
 {
-	if (f->off == f->s_off) return 0;
-	if (!f->f) return 0;
-	if (fseek(f->f, f->s_off, SEEK_SET) < 0)
-		return -1;
-	f->off = f->s_off;
-	return 0;
+	struct rlimit rl;
+
+	if (budget)
+		return budget;
+	budget = 1024;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur != RLIM_INFINITY))
+		budget = rl.rlim_cur;
+	if (budget > 0x10000)
+		budget = 0x10000;
+	budget -= FD_SPARE;
+	if (budget < 8)
+		budget = 8;
+	return budget;
 }
 
+/*\ Close the least recently used file that isn't being used.
+|*|  It's opened again when needed; nothing else about it changes.
+|*|  Returns 0 if there was nothing to close.
+\*/
 static int
-do_close(file_t f)
+lru_evict(void)
 {
-	int i;
-	if (!f->f) return 0;
-	i = fclose(f->f);
-	f->f = 0;
-	return i;
+	file_t f;
+
+	for (f = lru_tail; f && f->busy; f = f->prev)
+		;
+	if (!f)
+		return 0;
+	lru_unlink(f);
+	close(f->fd);
+	f->fd = -1;
+	nopen--;
+	if (f->dfd >= 0) {
+		close(f->dfd);
+		nopen--;
+	}
+	f->dfd = -1;
+	fd_closed++;
+	return 1;
+}
+
+/*\ How well the open files were kept open \*/
+void
+file_stats(void)
+{
+	if (fd_misses)
+		fprintf(stderr, "Open files: %ld reused, %ld opened, "
+			"%ld closed early (max %d)\n",
+			fd_hits, fd_misses, fd_closed, fd_budget());
 }
 
+/*\ Set up the file for reading or writing past the cache \*/
+static void
+direct_open(file_t f)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if (O_DIRECT)
+		f->dfd = open(f->name, (f->wr ? O_RDWR : O_RDONLY) | O_DIRECT);
+}
+
+/*\ Which descriptor to use for this transfer \*/
 static int
-do_open(file_t f)
+file_fd(file_t f, const void *buf, i64 n, i64 off)
 {
-	static file_t openfiles = 0;
-	int i;
-	while (!f->f) {
+	if ((f->dfd >= 0) && !(((unsigned long)buf | n | off) &
+				(DIRECT_ALIGN - 1)))
+		return f->dfd;
+	return f->fd;
+}
+
+/*\ Tell the cache we won't need this part of the file again \*/
+static void
+file_drop(file_t f, int fd, i64 off, i64 n)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (cmd.direct && (fd == f->fd) && (n > 0))
+		posix_fadvise(fd, off, n, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*\ Get a buffer that can be used for O_DIRECT transfers \*/
+void *
+file_buf(i64 n)
+{
+	void *p;
+
+	if (posix_memalign(&p, DIRECT_ALIGN, n))
+		return 0;
+	return p;
+}
+
+/*\ Make sure the file is open, and keep it that way until file_put().
+|*|  Returns the file descriptor, or -1.
+\*/
+static int
+file_get(file_t f)
+{
+	int i = -1;
+
+	pthread_mutex_lock(&openlock);
+	if (f->fd >= 0)
+		fd_hits++;
+	else
+		fd_misses++;
+	while (f->fd < 0) {
+		/*\ Two, in case of O_DIRECT \*/
+		while (((nopen + 2) > fd_budget()) && lru_evict())
+			;
 		/*\ This is so complicated to make sure we don't overwrite \*/
-		i = open(f->name, f->wr ? O_RDWR|O_CREAT|O_EXCL : O_RDONLY,
-				0666);
-		if (i >= 0) f->f = fdopen(i, f->wr ? "w+b" : "rb");
-		if (!f->f) {
-			if ((errno != EMFILE) && (errno != ENFILE))
-				return -1;
-			if (!openfiles)
-				return -1;
-			while (!openfiles->f)
-				openfiles = openfiles->next;
-			do_close(openfiles);
-			openfiles = openfiles->next;
-		} else {
-			f->off = 0;
-			if (!f->wr) {
-				f->next = openfiles;
-				openfiles = f;
-			}
+		switch (f->wr) {
+		case 0:
+			i = open(f->name, O_RDONLY);
+			break;
+		case 1:
+			i = open(f->name, O_RDWR|O_CREAT|O_EXCL, 0666);
+			break;
+		default:
+			/*\ Update an existing file in place \*/
+			i = open(f->name, O_RDWR);
+			break;
+		}
+		if (i >= 0) {
+			f->fd = i;
+			nopen++;
+			if (cmd.direct)
+				direct_open(f);
+			if (f->dfd >= 0)
+				nopen++;
+			break;
 		}
+		/*\ Someone else has the descriptors \*/
+		if ((errno != EMFILE) && (errno != ENFILE))
+			break;
+		if (!lru_evict())
+			break;
 	}
-	return do_seek(f);
+	if (f->fd >= 0) {
+		f->busy++;
+		if (!f->wr)
+			lru_touch(f);
+	}
+	i = f->fd;
+	pthread_mutex_unlock(&openlock);
+	return i;
+}
+
+static void
+file_put(file_t f)
+{
+	pthread_mutex_lock(&openlock);
+	f->busy--;
+	pthread_mutex_unlock(&openlock);
 }
 
+/*\ Open a file: 0 to read, 1 to create, 2 to update in place.
+|*|  It's opened right away, so errors show up here, as a 0 return
+|*|  with errno set.  Read-only files can be closed again while they
+|*|  aren't used, to make room for others, and are opened again later.
+\*/
 file_t
 file_open_ascii(const char *path, int wr)
 {
 	file_t f;
+	int e;
 
 	CNEW(f, 1);
 	NEW(f->name, strlen(path) + 1);
 	strcpy(f->name, path);
+	f->fd = -1;
+	f->dfd = -1;
 	f->wr = wr;
+	if (file_get(f) < 0) {
+		e = errno;
+		free(f->name);
+		free(f);
+		errno = e;
+		return 0;
+	}
+	file_put(f);
 	return f;
 }
 
@@ -227,9 +420,22 @@ file_open(const u16 *path, int wr)
 int
 file_close(file_t f)
 {
-	int i;
+	int i = 0;
+
 	if (!f) return 0;
-	i = do_close(f);
+	pthread_mutex_lock(&openlock);
+	lru_unlink(f);
+	if (f->fd >= 0)
+		nopen--;
+	if (f->dfd >= 0)
+		nopen--;
+	pthread_mutex_unlock(&openlock);
+	if (f->map)
+		munmap(f->map, f->maplen);
+	if (f->dfd >= 0)
+		close(f->dfd);
+	if (f->fd >= 0)
+		i = close(f->fd);
 	free(f->name);
 	free(f);
 	return i;
@@ -255,10 +461,15 @@ file_delete(u16 *file)
 int
 file_seek(file_t f, i64 off)
 {
-	f->s_off = off;
-	return do_seek(f);
+	f->off = off;
+	return 0;
 }
 
+i64
+file_tell(file_t f)
+{
+	return f->off;
+}
 
 char *
 complete_path(char *path)
@@ -312,18 +523,207 @@ read_dir(char *dir)
 	return rd;
 }
 
+/*\
+|*| Getting the data onto the disk.
+|*|  With --sync=<n>, writeback of every file is started each time
+|*|  another n MB has been written to it, after waiting for the
+|*|  previous batch, so dirty pages don't pile up.
+|*|  With --sync=end (or <n>), file_sync() makes sure the files
+|*|  are on disk, all at once.
+\*/
+static void
+file_written(file_t f, int fd, i64 off, i64 n)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	i64 from = 0, to = 0, done = 0;
+
+	if ((cmd.sync <= 0) || (n <= 0))
+		return;
+	pthread_mutex_lock(&openlock);
+	if (f->hi < off + n)
+		f->hi = off + n;
+	f->dirty += n;
+	if (f->dirty >= ((i64)cmd.sync << 20)) {
+		f->dirty = 0;
+		done = f->kick;
+		from = f->kick;
+		to = f->hi;
+		f->kick = f->hi;
+	}
+	pthread_mutex_unlock(&openlock);
+	if (to <= from)
+		return;
+	if (done)
+		sync_file_range(fd, 0, done, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	sync_file_range(fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+/*\ Make sure these files are on the disk.
+|*|  Writeback is started on all of them before waiting for any.
+|*|  Returns -1 with errno set if that failed for any of them.
+|*|  If bad is given, bad[i] is set for every file that failed.
+\*/
+int
+file_sync(file_t *fs, int n, u8 *bad)
+{
+	int i, fd, e = 0;
+
+	if (!cmd.sync)
+		return 0;
+#ifdef SYNC_FILE_RANGE_WRITE
+	for (i = 0; i < n; i++) {
+		if (!fs[i] || ((fd = file_get(fs[i])) < 0))
+			continue;
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		file_put(fs[i]);
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		if (!fs[i] || ((fd = file_get(fs[i])) < 0))
+			continue;
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+		if (fdatasync(fd) < 0)
+#else
+		if (fsync(fd) < 0)
+#endif
+		{
+			e = errno;
+			if (bad)
+				bad[i] = 1;
+		}
+		file_put(fs[i]);
+	}
+	if (e) {
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+/*\ Read n bytes at offset off, unless the file ends first.
+|*|  Returns the number of bytes read, -1 if nothing could be read.
+\*/
+i64
+file_pread(file_t f, void *buf, i64 n, i64 off)
+{
+	i64 i, r = 0;
+	int fd;
+
+	if (!f) return 0;
+	if (file_get(f) < 0)
+		return -1;
+	fd = file_fd(f, buf, n, off);
+	for (i = 0; i < n; i += r) {
+		r = pread(fd, (u8 *)buf + i, n - i, off + i);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		/*\ Some filesystems won't do O_DIRECT after all \*/
+		if (r < 0 && errno == EINVAL && fd == f->dfd) {
+			fd = f->fd;
+			r = 0;
+			continue;
+		}
+		if (r <= 0)
+			break;
+		/*\ The rest of a short transfer is no longer aligned \*/
+		if (fd == f->dfd && (r & (DIRECT_ALIGN - 1)))
+			fd = f->fd;
+	}
+	file_drop(f, fd, off, i);
+	file_put(f);
+	if ((i == 0) && (r < 0))
+		return -1;
+	return i;
+}
+
+i64
+file_pwrite(file_t f, const void *buf, i64 n, i64 off)
+{
+	i64 i, r = 0;
+	int fd;
+
+	if (!f) return 0;
+	if (file_get(f) < 0)
+		return -1;
+	fd = file_fd(f, buf, n, off);
+	for (i = 0; i < n; i += r) {
+		r = pwrite(fd, (const u8 *)buf + i, n - i, off + i);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		/*\ Some filesystems won't do O_DIRECT after all \*/
+		if (r < 0 && errno == EINVAL && fd == f->dfd) {
+			fd = f->fd;
+			r = 0;
+			continue;
+		}
+		if (r <= 0)
+			break;
+		/*\ The rest of a short transfer is no longer aligned \*/
+		if (fd == f->dfd && (r & (DIRECT_ALIGN - 1)))
+			fd = f->fd;
+	}
+	file_written(f, fd, off, i);
+	file_drop(f, fd, off, i);
+	file_put(f);
+	if ((i == 0) && (r < 0))
+		return -1;
+	return i;
+}
+
+/*\ Reserve disk space for the whole file up front, so it isn't
+|*|  written in bits and pieces all over the disk, and we know before
+|*|  starting that it will fit.
+|*|  Returns -1 with errno set if there isn't enough space.
+\*/
+int
+file_alloc(file_t f, i64 len)
+{
+	int fd, e = 0;
+
+	if (!f || (len <= 0)) return 0;
+	fd = file_get(f);
+	if (fd < 0)
+		return -1;
+	/*\ Sparse files only get their size, the rest stays a hole \*/
+	if (cmd.sparse) {
+		e = ftruncate(fd, len) ? errno : 0;
+		file_put(f);
+		if (e) {
+			errno = e;
+			return -1;
+		}
+		return 0;
+	}
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+	e = posix_fallocate(fd, 0, len);
+	/*\ Not every filesystem can do this, and that's fine \*/
+	if ((e == EINVAL) || (e == EOPNOTSUPP) || (e == ENOSYS))
+		e = 0;
+#endif
+	file_put(f);
+	if (e) {
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+/*\ Read or write at the file position, and move it along \*/
 i64
 file_read(file_t f, void *buf, i64 n)
 {
 	i64 i;
+
 	if (!f) return 0;
-	if (do_open(f) < 0)
-		return 0;
-	i = fread(buf, 1, n, f->f);
-	if (i > 0) {
+	i = file_pread(f, buf, n, f->off);
+	if (i > 0)
 		f->off += i;
-		f->s_off = f->off;
-	}
 	return i;
 }
 
@@ -331,31 +731,437 @@ i64
 file_write(file_t f, void *buf, i64 n)
 {
 	i64 i;
+
 	if (!f) return 0;
-	if (do_open(f) < 0)
-		return 0;
-	i = fwrite(buf, 1, n, f->f);
-	if (i > 0) {
+	i = file_pwrite(f, buf, n, f->off);
+	if (i > 0)
 		f->off += i;
-		f->s_off = f->off;
-	}
 	return i;
 }
 
-/*\ Calculate md5 sums on a file \*/
+/*\ Where does the file start on the disk ?
+|*|  Gives the physical offset of the first extent if the filesystem
+|*|  tells us, or else the inode number, which is usually close.
+|*|  Only good for sorting files.
+\*/
 i64
-file_md5(u16 *file, md5 block)
+file_place(file_t f)
 {
-	FILE *f;
-	i64 i;
+	struct stat st;
+	i64 r = 0;
+	int fd;
+
+	fd = file_get(f);
+	if (fd < 0)
+		return 0;
+#ifdef FS_IOC_FIEMAP
+	{
+		struct {
+			struct fiemap fm;
+			struct fiemap_extent fe;
+		} m;
+
+		memset(&m, 0, sizeof(m));
+		m.fm.fm_length = ~(u64)0;
+		m.fm.fm_extent_count = 1;
+		if (!ioctl(fd, FS_IOC_FIEMAP, &m) && m.fm.fm_mapped_extents &&
+		    !(m.fe.fe_flags & FIEMAP_EXTENT_UNKNOWN))
+			r = m.fe.fe_physical;
+	}
+#endif
+	if (!r && !fstat(fd, &st))
+		r = st.st_ino;
+	file_put(f);
+	return r;
+}
+
+/*\
+|*| Holes in sparse files.
+|*|  A part of a file that is known to be a hole doesn't have to be
+|*|  read, it's all zeroes.  What SEEK_DATA and SEEK_HOLE said last
+|*|  is remembered, so most calls don't need to ask again.
+\*/
+
+/*\ Is all of n bytes at offset off in a hole ?
+|*|  Only for files we don't write, and only inside the file.
+\*/
+int
+file_zero(file_t f, i64 off, i64 n)
+{
+#ifdef SEEK_DATA
+	struct stat st;
+	i64 d, h;
+	int fd, r;
+
+	if (!f || f->wr || (n <= 0)) return 0;
+	pthread_mutex_lock(&openlock);
+	r = -1;
+	if ((off >= f->zlo) && ((off + n) <= f->zhi))
+		r = 1;
+	else if ((off >= f->dlo) && (off < f->dhi))
+		r = 0;
+	pthread_mutex_unlock(&openlock);
+	if (r >= 0)
+		return r;
+
+	fd = file_get(f);
+	if (fd < 0)
+		return 0;
+	r = 0;
+	if (!fstat(fd, &st) && ((off + n) <= st.st_size)) {
+		d = lseek(fd, off, SEEK_DATA);
+		/*\ A hole up to the end of the file \*/
+		if ((d < 0) && (errno == ENXIO))
+			d = st.st_size;
+		h = st.st_size;
+		if ((d >= 0) && (d < st.st_size)) {
+			h = lseek(fd, d, SEEK_HOLE);
+			if (h < 0)
+				h = st.st_size;
+		}
+		if (d >= 0) {
+			pthread_mutex_lock(&openlock);
+			f->zlo = off;
+			f->zhi = d;
+			f->dlo = d;
+			f->dhi = h;
+			pthread_mutex_unlock(&openlock);
+			r = ((off + n) <= d);
+		}
+	}
+	file_put(f);
+	return r;
+#else
+	return 0;
+#endif
+}
+
+/*\
+|*| With --io=mmap, files are read straight out of the page cache.
+|*|  Every file has one window mapped at a time, which moves along
+|*|  as the file is read, so huge files still fit.
+\*/
+
+/*\ Bytes mapped per file at once \*/
+#define MAP_WINDOW 0x1000000
+
+/*\ Get a pointer to n bytes at offset off, mapped in.
+|*|  *got is set to the number of bytes there, which is less than n
+|*|  at the end of the file.  The pointer stays good until the next
+|*|  file_map() on this file, so only one thread may use it at a time.
+|*|  Returns 0 if the file can't be mapped.
+\*/
+const u8 *
+file_map(file_t f, i64 off, i64 n, i64 *got)
+{
+	static const u8 nothing[1];
+	struct stat st;
+	i64 a, l;
+	void *p;
+	int fd;
 
-	f = fopen(stuni(file), "rb");
 	if (!f) return 0;
-	i = md5_stream(f, block);
-	fclose(f);
+	if (f->map && (off >= f->mapoff) &&
+	    ((off + n) <= (f->mapoff + f->maplen))) {
+		*got = n;
+		return f->map + (off - f->mapoff);
+	}
+	fd = file_get(f);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0) {
+		file_put(f);
+		return 0;
+	}
+	if (off + n > st.st_size)
+		n = st.st_size - off;
+	*got = n;
+	if (n <= 0) {
+		*got = 0;
+		file_put(f);
+		return nothing;
+	}
+	a = off & ~((i64)sysconf(_SC_PAGESIZE) - 1);
+	l = (off - a) + n;
+	if (l < MAP_WINDOW)
+		l = MAP_WINDOW;
+	if (a + l > st.st_size)
+		l = st.st_size - a;
+	if (f->map)
+		munmap(f->map, f->maplen);
+	f->map = 0;
+	p = mmap(0, l, PROT_READ, MAP_SHARED, fd, a);
+	file_put(f);
+	if (p == MAP_FAILED)
+		return 0;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, l, MADV_SEQUENTIAL);
+#endif
+	f->map = p;
+	f->mapoff = a;
+	f->maplen = l;
+	return f->map + (off - a);
+}
+
+/*\ The device a file is on, -1 if unknown \*/
+i64
+file_dev(file_t f)
+{
+	struct stat st;
+	int fd;
+
+	if (!f) return -1;
+	fd = file_get(f);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		file_put(f);
+		return -1;
+	}
+	file_put(f);
+	return st.st_dev;
+}
+
+/*\ What's in a hole \*/
+static const u8 zeros[MD5_CHUNK];
+
+/*\ Hash the first 16k of a file (or less, if that's all there is),
+|*|  and take the 16k hash and the magic number on the way.
+|*|  Returns the number of bytes hashed.
+\*/
+static i64
+md5_head(const u8 *p, i64 n, struct md5_ctx *ctx, md5 block16k, i64 *magic)
+{
+	struct md5_ctx c;
+
+	if (n > 16384)
+		n = 16384;
+	*magic = 0;
+	memcpy(magic, p, (n < 8) ? n : 8);
+	md5_process_bytes(p, n, ctx);
+	c = *ctx;
+	md5_finish_ctx(&c, block16k);
+	return n;
+}
+
+/*\ Hash the next n bytes, tot bytes into the file \*/
+static void
+md5_add(struct md5_ctx *ctx, const u8 *p, i64 n, i64 tot,
+		md5 block16k, i64 *magic)
+{
+	i64 k = 0;
+
+	if (block16k && !tot)
+		k = md5_head(p, n, ctx, block16k, magic);
+	md5_process_bytes(p + k, n - k, ctx);
+}
+
+/*\ Calculate the md5 sum from offset 'off' to the end of the file.
+|*|  If block16k is given (only from offset 0), the 16k hash and the
+|*|  magic number come out of the same pass.
+|*|  Returns the number of bytes, -1 on failure.
+\*/
+static i64
+do_md5(file_t f, i64 off, md5 block, md5 block16k, i64 *magic)
+{
+	struct md5_ctx ctx;
+	u8 *buf;
+	i64 n, tot = 0;
+
+	md5_init_ctx(&ctx);
+	if (cmd.io == IO_MMAP) {
+		const u8 *p;
+
+		for (;;) {
+			if (file_zero(f, off + tot, MD5_CHUNK)) {
+				md5_add(&ctx, zeros, MD5_CHUNK, tot,
+						block16k, magic);
+				tot += MD5_CHUNK;
+				continue;
+			}
+			p = file_map(f, off + tot, MD5_CHUNK, &n);
+			if (!p)
+				break;
+			md5_add(&ctx, p, n, tot, block16k, magic);
+			tot += n;
+			if (n < MD5_CHUNK) {
+				md5_finish_ctx(&ctx, block);
+				return tot;
+			}
+		}
+		/*\ Can't be mapped, read the rest \*/
+	}
+	buf = file_buf(MD5_CHUNK);
+	for (;;) {
+		/*\ Don't read holes, we know what's in them \*/
+		if (file_zero(f, off + tot, MD5_CHUNK)) {
+			md5_add(&ctx, zeros, MD5_CHUNK, tot, block16k, magic);
+			tot += MD5_CHUNK;
+			continue;
+		}
+		n = file_pread(f, buf, MD5_CHUNK, off + tot);
+		if (n != MD5_CHUNK)
+			break;
+		md5_add(&ctx, buf, n, tot, block16k, magic);
+		tot += n;
+	}
+	if (n >= 0) {
+		md5_add(&ctx, buf, n, tot, block16k, magic);
+		tot += n;
+	}
+	free(buf);
+	if (n < 0)
+		return -1;
+	md5_finish_ctx(&ctx, block);
+	return tot;
+}
+
+/*\ Calculate md5 sums on a file, and the 16k hash if block16k is given \*/
+i64
+file_md5(u16 *file, md5 block, md5 block16k, i64 *magic)
+{
+	file_t f;
+	i64 i;
+
+	f = file_open(file, 0);
+	if (!f) return -1;
+	i = do_md5(f, 0, block, block16k, magic);
+	file_close(f);
 	return i;
 }
 
+/*\ One file being hashed by file_md5_many() \*/
+struct lane {
+	file_t f;
+	int i;		/*\ Index in the list of files \*/
+	u8 *buf;
+	const u8 *p;	/*\ Data not yet hashed \*/
+	i64 len;
+	i64 off;	/*\ Read up to here \*/
+	int eof;
+	struct md5_ctx ctx;
+};
+
+/*\ Get the next chunk of a file into a lane \*/
+static void
+lane_fill(struct lane *l)
+{
+	i64 n = -1;
+
+	if (file_zero(l->f, l->off, MD5_CHUNK)) {
+		l->p = zeros;
+		n = MD5_CHUNK;
+	} else {
+		if (cmd.io == IO_MMAP)
+			l->p = file_map(l->f, l->off, MD5_CHUNK, &n);
+		if ((cmd.io != IO_MMAP) || !l->p) {
+			l->p = l->buf;
+			n = file_pread(l->f, l->buf, MD5_CHUNK, l->off);
+		}
+	}
+	if (n < MD5_CHUNK)
+		l->eof = 1;
+	if (n < 0) {
+		l->eof = -1;
+		n = 0;
+	}
+	l->len = n;
+	l->off += n;
+}
+
+/*\ Calculate md5 sums on a list of open files.
+|*|  As many files as there are MD5 lanes are read side by side,
+|*|  and their blocks go through the multi-buffer MD5 together.
+|*|  The 16k hashes and magic numbers are taken on the way.
+|*|  size[i] gets the file size, or -1 on failure.
+\*/
+void
+file_md5_many(file_t *f, md5 *block, md5 *block16k, i64 *magic,
+		i64 *size, int n)
+{
+	struct lane l[MD5MB_MAX];
+	struct md5_ctx *ctx[MD5MB_MAX];
+	const u8 *p[MD5MB_MAX];
+	int i, j, k, nl, next = 0;
+	i64 nb;
+
+	nl = md5mb_lanes();
+	if (nl > n)
+		nl = n;
+	for (j = 0; j < nl; j++) {
+		l[j].f = 0;
+		l[j].buf = file_buf(MD5_CHUNK);
+	}
+	for (;;) {
+		/*\ Put new files in the empty lanes \*/
+		for (j = 0; j < nl; j++) {
+			while (!l[j].f && (next < n)) {
+				l[j].i = next++;
+				l[j].f = f[l[j].i];
+				if (!l[j].f) {
+					size[l[j].i] = -1;
+					continue;
+				}
+				l[j].len = l[j].off = 0;
+				l[j].eof = 0;
+				md5_init_ctx(&l[j].ctx);
+			}
+		}
+		/*\ Refill, and finish the files that are done \*/
+		nb = -1;
+		for (j = k = 0; j < nl; j++) {
+			if (!l[j].f)
+				continue;
+			if (!l[j].len && !l[j].eof) {
+				lane_fill(&l[j]);
+				/*\ The first 16k is done on its own \*/
+				if (l[j].off == l[j].len) {
+					i = md5_head(l[j].p, l[j].len,
+						&l[j].ctx, block16k[l[j].i],
+						magic + l[j].i);
+					l[j].p += i;
+					l[j].len -= i;
+				}
+			}
+			if ((l[j].len < 64) && l[j].eof) {
+				i = l[j].i;
+				if (l[j].eof < 0) {
+					size[i] = -1;
+				} else {
+					md5_process_bytes(l[j].p, l[j].len,
+							&l[j].ctx);
+					md5_finish_ctx(&l[j].ctx, block[i]);
+					size[i] = l[j].off;
+				}
+				l[j].f = 0;
+				continue;
+			}
+			if ((nb < 0) || (l[j].len / 64 < nb))
+				nb = l[j].len / 64;
+			ctx[k] = &l[j].ctx;
+			p[k++] = l[j].p;
+		}
+		if (!k) {
+			if (next < n)
+				continue;
+			break;
+		}
+		/*\ Hash the blocks all lanes have \*/
+		if (k == 1)
+			md5_process_block(p[0], nb * 64, ctx[0]);
+		else
+			md5mb_blocks(ctx, p, k, nb);
+		for (j = 0; j < nl; j++) {
+			if (!l[j].f)
+				continue;
+			l[j].p += nb * 64;
+			l[j].len -= nb * 64;
+		}
+	}
+	for (j = 0; j < nl; j++)
+		free(l[j].buf);
+}
+
 int
 file_md5_buffer(u16 *file, md5 block, u8 *buf, i64 size)
 {
@@ -364,7 +1170,7 @@ file_md5_buffer(u16 *file, md5 block, u8 *buf, i64 size)
 
 	f = file_open(file, 0);
 	if (!f) return 0;
-	s = file_read(f, buf, size);
+	s = file_pread(f, buf, size, 0);
 	file_close(f);
 	if (s < 0) return 0;
 	return (md5_buffer(buf, s, block) != 0);
@@ -381,20 +1187,13 @@ file_add_md5(file_t f, i64 md5off, i64 off, i64 len)
 	i64 i;
 
 	if (!f) return 0;
-	f->s_off = off;
-	if (do_open(f) < 0)
-		return 0;
-	i = md5_stream(f->f, hash);
+	i = do_md5(f, off, hash, 0, 0);
 	if (i < 0)
 		return 0;
-	f->off += i;
-	f->s_off = f->off;
-	/*\ Filepointer should be at EOF now \*/
-	if (f->off != len)
+	/*\ Should have gone up to EOF \*/
+	if (off + i != len)
 		return 0;
-	if (file_seek(f, md5off) < 0)
-		return 0;
-	if (file_write(f, hash, sizeof(hash)) < 0)
+	if (file_pwrite(f, hash, sizeof(hash), md5off) != sizeof(hash))
 		return 0;
 	return 1;
 }
@@ -403,14 +1202,442 @@ file_add_md5(file_t f, i64 md5off, i64 off, i64 len)
 int
 file_get_md5(file_t f, i64 off, md5 block)
 {
-	i64 i, tmp = f->off;
+	return (do_md5(f, off, block, 0, 0) > 0);
+}
 
-	f->s_off = off;
-	if (do_open(f) < 0)
-		return 0;
-	i = md5_stream(f->f, block);
-	f->s_off = tmp;
+/*\
+|*| Queues of reads and writes, that run while we do something else.
+|*|  On Linux this uses io_uring, so all reads of a stripe go to the
+|*|  disks at once.  Anywhere else, or if the kernel won't let us,
+|*|  a reader and a writer thread work through the queued reads and
+|*|  writes, in order.  With --io=sync, every read and write is simply
+|*|  done when it's queued.
+\*/
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
 
-	return (i != 0);
+#ifdef HAVE_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+struct fop {
+	file_t f;
+	u8 *buf;
+	i64 n, off;
+	i64 *res;
+	int wr;
+	int next;	/*\ Next free entry \*/
+};
+
+/*\ Operations waiting for a reader or writer thread \*/
+struct fring {
+	fqueue_t *q;
+	struct fop *ops;
+	int head, cnt;
+};
+
+struct fqueue_s {
+	int fd;		/*\ io_uring, -1 if it isn't used \*/
+	int nops, free;
+	struct fop *ops;
+	int queued;	/*\ Not given to the kernel yet \*/
+	int busy;	/*\ Not completed yet \*/
+	int nth;	/*\ Number of threads running, 0 if none \*/
+	int stop;	/*\ Tell the threads to finish \*/
+	pthread_t th[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fring ring[2];	/*\ Reads and writes \*/
+#ifdef HAVE_URING
+	u8 *sq, *cq;
+	size_t sqsize, cqsize, sqesize;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+/*\ Do (the rest of) an operation the normal way \*/
+static void
+fop_sync(struct fop *op, i64 done)
+{
+	i64 r;
+
+	if (op->wr)
+		r = file_pwrite(op->f, op->buf + done, op->n - done,
+				op->off + done);
+	else
+		r = file_pread(op->f, op->buf + done, op->n - done,
+				op->off + done);
+	if (r > 0)
+		done += r;
+	*op->res = (done || (r >= 0)) ? done : -1;
 }
 
+#ifdef HAVE_URING
+static int
+uring_setup(fqueue_t *q, unsigned entries)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+	q->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->cqsize > q->sqsize)
+			q->sqsize = q->cqsize;
+		q->cqsize = 0;
+	}
+	q->sq = mmap(0, q->sqsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (q->sq == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	q->cq = q->sq;
+	if (q->cqsize) {
+		q->cq = mmap(0, q->cqsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (q->cq == MAP_FAILED) {
+			munmap(q->sq, q->sqsize);
+			close(fd);
+			return -1;
+		}
+	}
+	q->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(0, q->sqesize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED) {
+		if (q->cqsize)
+			munmap(q->cq, q->cqsize);
+		munmap(q->sq, q->sqsize);
+		close(fd);
+		return -1;
+	}
+	q->sqhead = (unsigned *)(q->sq + p.sq_off.head);
+	q->sqtail = (unsigned *)(q->sq + p.sq_off.tail);
+	q->sqmask = (unsigned *)(q->sq + p.sq_off.ring_mask);
+	q->sqarray = (unsigned *)(q->sq + p.sq_off.array);
+	q->cqhead = (unsigned *)(q->cq + p.cq_off.head);
+	q->cqtail = (unsigned *)(q->cq + p.cq_off.tail);
+	q->cqmask = (unsigned *)(q->cq + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(q->cq + p.cq_off.cqes);
+	q->nops = p.sq_entries;
+	return fd;
+}
+
+/*\ Give queued operations to the kernel, and maybe wait for one \*/
+static void
+uring_enter(fqueue_t *q, int wait)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, q->fd, q->queued,
+			wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+		if (r > 0)
+			q->queued -= r;
+	} while ((r < 0) && (errno == EINTR));
+}
+
+/*\ Handle all completed operations \*/
+static void
+uring_reap(fqueue_t *q)
+{
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	struct fop *op;
+	int i;
+
+	head = *q->cqhead;
+	tail = __atomic_load_n(q->cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = q->cqes + (head & *q->cqmask);
+		i = cqe->user_data;
+		op = q->ops + i;
+		/*\ Short read or write, or O_DIRECT not possible after all:
+		|*|  do the rest the normal way
+		\*/
+		if ((cqe->res > 0) && (cqe->res < op->n))
+			fop_sync(op, cqe->res);
+		else if (cqe->res == -EINVAL)
+			fop_sync(op, 0);
+		else {
+			*op->res = (cqe->res < 0) ? -1 : cqe->res;
+			if (op->wr)
+				file_written(op->f, op->f->fd, op->off,
+						*op->res);
+			file_drop(op->f, file_fd(op->f, op->buf, op->n,
+					op->off), op->off, op->n);
+		}
+		file_put(op->f);
+		op->next = q->free;
+		q->free = i;
+		q->busy--;
+	}
+	__atomic_store_n(q->cqhead, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/*\ Reader or writer thread \*/
+static void *
+fq_thread(void *arg)
+{
+	struct fring *rg = arg;
+	fqueue_t *q = rg->q;
+	struct fop op;
+	i64 res, *p;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!rg->cnt && !q->stop)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (!rg->cnt)
+			break;
+		op = rg->ops[rg->head];
+		pthread_mutex_unlock(&q->lock);
+
+		/*\ Only hand over the result with the lock held \*/
+		p = op.res;
+		op.res = &res;
+		fop_sync(&op, 0);
+
+		pthread_mutex_lock(&q->lock);
+		*p = res;
+		rg->head = (rg->head + 1) % q->nops;
+		rg->cnt--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/*\ Start a reader and a writer thread \*/
+static void
+fq_threads(fqueue_t *q, int depth)
+{
+	int i;
+
+	q->nops = depth;
+	pthread_mutex_init(&q->lock, 0);
+	pthread_cond_init(&q->cond, 0);
+	for (i = 0; i < 2; i++) {
+		NEW(q->ring[i].ops, depth);
+		q->ring[i].q = q;
+	}
+	for (q->nth = 0; q->nth < 2; q->nth++)
+		if (pthread_create(&q->th[q->nth], 0, fq_thread,
+					q->ring + q->nth))
+			break;
+	if (q->nth < 2) {
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		for (i = 0; i < q->nth; i++)
+			pthread_join(q->th[i], 0);
+		q->nth = 0;
+	}
+}
+
+fqueue_t *
+fq_open(int depth)
+{
+	fqueue_t *q;
+	unsigned n;
+	int i;
+
+	CNEW(q, 1);
+	q->fd = -1;
+	q->free = -1;
+#ifdef HAVE_URING
+	if ((cmd.io != IO_SYNC) && (cmd.io != IO_THREADS)) {
+		for (n = 1; (n < (unsigned)depth) && (n < 0x1000); n <<= 1)
+			;
+		q->fd = uring_setup(q, n);
+		if ((q->fd < 0) && (cmd.io == IO_URING))
+			perror("io_uring");
+	}
+	if (q->fd >= 0) {
+		NEW(q->ops, q->nops);
+		for (i = 0; i < q->nops; i++)
+			q->ops[i].next = i + 1;
+		q->ops[q->nops - 1].next = -1;
+		q->free = 0;
+	}
+#endif
+	if ((q->fd < 0) && (cmd.io != IO_SYNC))
+		fq_threads(q, depth);
+	if ((cmd.loglevel > 0) && (q->fd >= 0))
+		fprintf(stderr, "Using io_uring, %d deep\n", q->nops);
+	if ((cmd.loglevel > 0) && q->nth)
+		fprintf(stderr, "Using reader and writer threads\n");
+	return q;
+}
+
+static void
+fq_add(fqueue_t *q, file_t f, void *buf, i64 n, i64 off, i64 *res, int wr)
+{
+	struct fop *op, tmp;
+
+	*res = FQ_BUSY;
+#ifdef HAVE_URING
+	if (q->fd >= 0) {
+		struct io_uring_sqe *sqe;
+		unsigned tail;
+		int i, fd;
+
+		/*\ Wait for room \*/
+		while (q->free < 0) {
+			uring_enter(q, 1);
+			uring_reap(q);
+		}
+		/*\ Out of descriptors: wait for our own reads and writes,
+		|*|  which keep files open, to finish first.
+		\*/
+		while (((fd = file_get(f)) < 0) && q->busy &&
+		       ((errno == EMFILE) || (errno == ENFILE))) {
+			uring_enter(q, 1);
+			uring_reap(q);
+		}
+		if (fd >= 0) {
+			fd = file_fd(f, buf, n, off);
+			i = q->free;
+			op = q->ops + i;
+			q->free = op->next;
+			op->f = f;
+			op->buf = buf;
+			op->n = n;
+			op->off = off;
+			op->res = res;
+			op->wr = wr;
+			tail = *q->sqtail;
+			sqe = q->sqes + (tail & *q->sqmask);
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = wr ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long)buf;
+			sqe->len = n;
+			sqe->off = off;
+			sqe->user_data = i;
+			q->sqarray[tail & *q->sqmask] = tail & *q->sqmask;
+			__atomic_store_n(q->sqtail, tail + 1, __ATOMIC_RELEASE);
+			q->queued++;
+			q->busy++;
+			return;
+		}
+	}
+#endif
+	if (q->nth) {
+		struct fring *rg = q->ring + (wr ? 1 : 0);
+
+		pthread_mutex_lock(&q->lock);
+		while (rg->cnt == q->nops)
+			pthread_cond_wait(&q->cond, &q->lock);
+		op = rg->ops + ((rg->head + rg->cnt) % q->nops);
+		op->f = f;
+		op->buf = buf;
+		op->n = n;
+		op->off = off;
+		op->res = res;
+		op->wr = wr;
+		rg->cnt++;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	op = &tmp;
+	op->f = f;
+	op->buf = buf;
+	op->n = n;
+	op->off = off;
+	op->res = res;
+	op->wr = wr;
+	fop_sync(op, 0);
+}
+
+void
+fq_read(fqueue_t *q, file_t f, void *buf, i64 n, i64 off, i64 *res)
+{
+	fq_add(q, f, buf, n, off, res, 0);
+}
+
+void
+fq_write(fqueue_t *q, file_t f, const void *buf, i64 n, i64 off, i64 *res)
+{
+	fq_add(q, f, (void *)buf, n, off, res, 1);
+}
+
+void
+fq_submit(fqueue_t *q)
+{
+#ifdef HAVE_URING
+	if ((q->fd >= 0) && q->queued)
+		uring_enter(q, 0);
+#endif
+}
+
+void
+fq_wait(fqueue_t *q, i64 *res)
+{
+	if (q->nth) {
+		pthread_mutex_lock(&q->lock);
+		while (*res == FQ_BUSY)
+			pthread_cond_wait(&q->cond, &q->lock);
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+#ifdef HAVE_URING
+	if (q->fd < 0)
+		return;
+	uring_reap(q);
+	while (*res == FQ_BUSY) {
+		uring_enter(q, 1);
+		uring_reap(q);
+	}
+#endif
+}
+
+void
+fq_close(fqueue_t *q)
+{
+	int i;
+
+	if (!q) return;
+	if (q->nth) {
+		/*\ The threads finish what's queued first \*/
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		for (i = 0; i < q->nth; i++)
+			pthread_join(q->th[i], 0);
+	}
+	for (i = 0; i < 2; i++)
+		free(q->ring[i].ops);
+#ifdef HAVE_URING
+	if (q->fd >= 0) {
+		while (q->busy) {
+			uring_enter(q, 1);
+			uring_reap(q);
+		}
+		munmap(q->sqes, q->sqesize);
+		if (q->cqsize)
+			munmap(q->cq, q->cqsize);
+		munmap(q->sq, q->sqsize);
+		close(q->fd);
+	}
+#endif
+	free(q->ops);
+	free(q);
+}
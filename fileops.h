@@ -29,13 +29,24 @@ struct hfile_s {
 };
 
 struct file_s {
-	file_t next;
-	FILE *f;
+	file_t next, prev;	/*\ In the list of open read-only files \*/
+	int fd;		/*\ -1 while closed \*/
+	int dfd;	/*\ Same file with O_DIRECT, -1 if not used \*/
+	int busy;	/*\ Reads and writes going on \*/
 	char *name;
-	i64 off, s_off;
-	int wr;
+	i64 off;	/*\ Position for file_read() and file_write() \*/
+	int wr;		/*\ 1: create new file, 2: update in place \*/
+	u8 *map;	/*\ Window mapped with file_map(), or 0 \*/
+	i64 mapoff, maplen;
+	i64 dirty;	/*\ Written since writeback was last started \*/
+	i64 kick, hi;	/*\ Writeback started up to, written up to \*/
+	i64 zlo, zhi;	/*\ Known to be a hole \*/
+	i64 dlo, dhi;	/*\ Known to be data \*/
 };
 
+/*\ Bytes read in one go for md5 sums \*/
+#define MD5_CHUNK 0x40000
+
 #define HASH16K 1
 #define HASH 2
 
@@ -53,7 +64,10 @@ int file_close(file_t f);
 int file_exists(u16 *file);
 int file_delete(u16 *file);
 int file_seek(file_t f, i64 off);
-i64 file_md5(u16 *file, md5 block);
+i64 file_tell(file_t f);
+i64 file_md5(u16 *file, md5 block, md5 block16k, i64 *magic);
+void file_md5_many(file_t *f, md5 *block, md5 *block16k, i64 *magic,
+		i64 *size, int n);
 int file_md5_buffer(u16 *file, md5 block, u8 *buf, i64 size);
 int file_add_md5(file_t f, i64 md5off, i64 off, i64 len);
 int file_get_md5(file_t f, i64 off, md5 block);
@@ -61,5 +75,30 @@ char * complete_path(char *path);
 hfile_t *read_dir(char *dir);
 i64 file_read(file_t f, void *buf, i64 n);
 i64 file_write(file_t f, void *buf, i64 n);
+i64 file_pread(file_t f, void *buf, i64 n, i64 off);
+i64 file_pwrite(file_t f, const void *buf, i64 n, i64 off);
+void *file_buf(i64 n);
+int file_alloc(file_t f, i64 len);
+int file_sync(file_t *fs, int n, u8 *bad);
+void file_stats(void);
+const u8 *file_map(file_t f, i64 off, i64 n, i64 *got);
+i64 file_place(file_t f);
+int file_zero(file_t f, i64 off, i64 n);
+i64 file_dev(file_t f);
+
+/*\ Queued reads and writes.  *res is FQ_BUSY until the operation is
+|*|  done, then the number of bytes transferred, or -1.
+|*|  The buffer and *res must stay around until then.
+\*/
+typedef struct fqueue_s fqueue_t;
+#define FQ_BUSY (-2)
+
+fqueue_t *fq_open(int depth);
+void fq_read(fqueue_t *q, file_t f, void *buf, i64 n, i64 off, i64 *res);
+void fq_write(fqueue_t *q, file_t f, const void *buf, i64 n, i64 off,
+		i64 *res);
+void fq_submit(fqueue_t *q);
+void fq_wait(fqueue_t *q, i64 *res);
+void fq_close(fqueue_t *q);
 
 #endif
@@ -11,8 +11,10 @@
 \*/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include "util.h"
 #include "fileops.h"
 #include "rwpar.h"
 #include "backend.h"
@@ -43,6 +45,10 @@ usage(void)
 "    -p<n>: Number of files per parity volume\n"
 " or -n<n>: Number of parity volumes to create\n"
 "    -d   : Search for duplicate files\n"
+"    -j<n>: Use n threads for Reed-Solomon coding (0: one per CPU)\n"
+"    -t<n>: Reed-Solomon tile size in KB (0: from cache size)\n"
+"    -x   : Use the slower XOR-only (bit matrix) Reed-Solomon engine\n"
+"    -r   : Repair damaged files in place, if possible\n"
 "    -k   : Keep broken files\n"
 "    -s   : Be smart if filenames are consistently different.\n"
 "    +i   : Do not add following files to parity volumes\n"
@@ -51,6 +57,14 @@ usage(void)
 "    +H   : Do not check control hashes\n"
 "    -v,+v: Increase or decrease verbosity\n"
 "    -h,-?: Display this help\n"
+"    --io=uring|threads|sync|mmap: Read and write with io_uring, with\n"
+"         separate threads, one at a time, or from memory mapped files\n"
+"    --io=hdd: Read big chunks of the files, in the order they're on disk\n"
+"    --align=<n>: Start the data in new volumes at a multiple of n bytes\n"
+"    --sync=none|end|<n>: Don't sync written files, sync them at the end,\n"
+"         or also start writing them out every n MB\n"
+"    --sparse: Write runs of zeroes in restored files as holes\n"
+"    --direct: Don't fill the page cache with the files being processed\n"
 "    --   : Always treat following arguments as files\n"
 "\n"
 	);
@@ -81,9 +95,102 @@ check_sizes(void)
 	return fail;
 }
 
+/*\ Read a number following a switch, maybe from the next argument.
+|*|  Leaves p at the last digit.
+\*/
+static void
+get_value(char **pp, int *argcp, char ***argvp, int *val)
+{
+	char *p = *pp;
+
+	while (isspace(*++p))
+		;
+	if (!*p && (*argcp > 2)) {
+		(*argvp)++;
+		(*argcp)--;
+		p = (*argvp)[1];
+	}
+	if (!isdigit(*p)) {
+		fprintf(stderr, "Value expected!\n");
+		*pp = p - 1;
+		return;
+	}
+	*val = 0;
+	do {
+		*val *= 10;
+		*val += *p - '0';
+	} while (isdigit(*++p));
+	*pp = p - 1;
+}
+
+/*\
+|*| Options that don't fit in one letter, as --name=value
+|*| Returns 0 if the option isn't known.
+\*/
+static int
+long_option(const char *p)
+{
+	if (!strcmp(p, "io=uring")) {
+		cmd.io = IO_URING;
+	} else if (!strcmp(p, "io=sync")) {
+		cmd.io = IO_SYNC;
+	} else if (!strcmp(p, "io=hdd")) {
+		cmd.hdd = 1;
+	} else if (!strcmp(p, "io=threads")) {
+		cmd.io = IO_THREADS;
+	} else if (!strcmp(p, "io=mmap")) {
+		cmd.io = IO_MMAP;
+	} else if (!strcmp(p, "io=auto")) {
+		cmd.io = IO_AUTO;
+	} else if (!strncmp(p, "align=", 6) && isdigit(p[6])) {
+		cmd.align = atoi(p + 6);
+	} else if (!strcmp(p, "sync=none")) {
+		cmd.sync = 0;
+	} else if (!strcmp(p, "sync=end")) {
+		cmd.sync = -1;
+	} else if (!strncmp(p, "sync=", 5) && isdigit(p[5])) {
+		cmd.sync = atoi(p + 5);
+	} else if (!strcmp(p, "sparse")) {
+		cmd.sparse = 1;
+	} else if (!strcmp(p, "direct")) {
+		cmd.direct = 1;
+	} else {
+		fprintf(stderr, "Unknown option: '--%s'\n", p);
+		return 0;
+	}
+	return 1;
+}
+
 /*\ In ui_text.h \*/
 void ui_text(void);
 
+/*\
+|*| Hash the files that are about to be added all at once.
+|*|  They're still added one by one, between the options.
+\*/
+static void
+hash_args(int argc, char *argv[])
+{
+	hfile_t **list;
+	int i, n, dash = cmd.dash;
+
+	NEW(list, argc);
+	for (i = n = 0; i < argc; i++) {
+		if (!dash && !strcmp(argv[i], "--")) {
+			dash = 1;
+			continue;
+		}
+		if (!dash && ((argv[i][0] == '-') || (argv[i][0] == '+')) &&
+		    argv[i][1])
+			continue;
+		list[n] = find_file_name(unist(argv[i]), 0);
+		if (list[n])
+			n++;
+	}
+	hash_files(list, n);
+	free(list);
+}
+
 /*\
 |*| Main loop.  Simple stuff.
 \*/
@@ -100,6 +207,7 @@ main(int argc, char *argv[])
 	/*\ Some defaults \*/
 	memset(&cmd, 0, sizeof(cmd));
 	cmd.volumes = 10;
+	cmd.threads = 1;
 	cmd.pervol = 1;
 	cmd.pxx = 1;
 	cmd.ctrl = 1;
@@ -109,6 +217,11 @@ main(int argc, char *argv[])
 	if (argc == 1) return usage();
 
 	for (; argc > 1; argc--, argv++) {
+		if ((argv[1][0] == '-') && (argv[1][1] == '-') &&
+		    argv[1][2] && !cmd.dash) {
+			long_option(argv[1] + 2);
+			continue;
+		}
 		if (((argv[1][0] == '-') || (argv[1][0] == '+')) &&
 		    argv[1][1] && !cmd.dash) {
 			for (p = argv[1]; *p; p++) switch (*p) {
@@ -145,23 +258,19 @@ main(int argc, char *argv[])
 			case 'p':
 			case 'n':
 				cmd.pervol = (*p == 'p');
-				while (isspace(*++p))
-					;
-				if (!*p) {
-					argv++;
-					argc--;
-					p = argv[1];
-				}
-				if (!isdigit(*p)) {
-					fprintf(stderr, "Value expected!\n");
-				} else {
-					cmd.volumes = 0;
-					do {
-						cmd.volumes *= 10;
-						cmd.volumes += *p - '0';
-					} while (isdigit(*++p));
-					p--;
-				}
+				get_value(&p, &argc, &argv, &cmd.volumes);
+				break;
+			case 'j':
+				get_value(&p, &argc, &argv, &cmd.threads);
+				break;
+			case 't':
+				get_value(&p, &argc, &argv, &cmd.tile);
+				break;
+			case 'x':
+				cmd.bitmat = cmd.plus;
+				break;
+			case 'r':
+				cmd.repair = cmd.plus;
 				break;
 			case 'H':
 				cmd.ctrl = cmd.plus;
@@ -235,6 +344,7 @@ main(int argc, char *argv[])
 			par = read_par_header(unist(argv[1]), 1, 0, 0);
 			if (!par) return 2;
 			cmd.action = ACTION_ADDING;
+			hash_args(argc - 2, argv + 2);
 			break;
 		case ACTION_ADDING:
 			par_add_file(par, find_file_name(unist(argv[1]), 1));
@@ -270,5 +380,7 @@ main(int argc, char *argv[])
 			fail |= 1;
 		free_par(par);
 	}
+	if (cmd.loglevel > 0)
+		file_stats();
 	return fail;
 }
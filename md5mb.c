@@ -0,0 +1,216 @@
+/*\
+|*|  Parity Archive - A way to restore missing files in a set.
+|*|
+|*|  Copyright (C) 2001  Willem Monsuwe (willem@stack.nl)
+|*|
+|*|  Multi-buffer MD5.
+|*|   One MD5 stream can't go faster than one round after the other,
+|*|   but independent streams can run side by side, one in every lane
+|*|   of a SIMD register: 4 with SSE2, 8 with AVX2, 16 with AVX-512.
+\*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "md5mb.h"
+#include "par.h"
+
+/*\ Shift amounts and constants for the 64 steps (RFC 1321) \*/
+static const int S[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const u32 T[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/*\ Which word of the block every step uses \*/
+static const int K[64] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+	5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+	0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+static u32
+le32(const u8 *b)
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((u32)b[3] << 24);
+}
+
+/*\ The same code for every lane count, with GCC vector types.
+|*|  st holds A, B, C and D of every lane, p the data of every lane.
+\*/
+#define MD5MB_KERNEL(L)							\
+	typedef u32 v __attribute__((vector_size(4 * (L))));		\
+	v a, b, c, d, f, x[16];						\
+	v a0, b0, c0, d0;						\
+	u32 w[L];							\
+	i64 blk;							\
+	int i, l;							\
+									\
+	memcpy(&a, st[0], sizeof(v));					\
+	memcpy(&b, st[1], sizeof(v));					\
+	memcpy(&c, st[2], sizeof(v));					\
+	memcpy(&d, st[3], sizeof(v));					\
+	for (blk = 0; blk < nblk; blk++) {				\
+		for (i = 0; i < 16; i++) {				\
+			for (l = 0; l < (L); l++)			\
+				w[l] = le32(p[l] + blk * 64 + i * 4);	\
+			memcpy(&x[i], w, sizeof(v));			\
+		}							\
+		a0 = a; b0 = b; c0 = c; d0 = d;				\
+		for (i = 0; i < 64; i++) {				\
+			if (i < 16)					\
+				f = d ^ (b & (c ^ d));			\
+			else if (i < 32)				\
+				f = c ^ (d & (b ^ c));			\
+			else if (i < 48)				\
+				f = b ^ c ^ d;				\
+			else						\
+				f = c ^ (b | ~d);			\
+			f += a + x[K[i]] + T[i];			\
+			a = d; d = c; c = b;				\
+			b += (f << S[i]) | (f >> (32 - S[i]));		\
+		}							\
+		a += a0; b += b0; c += c0; d += d0;			\
+	}								\
+	memcpy(st[0], &a, sizeof(v));					\
+	memcpy(st[1], &b, sizeof(v));					\
+	memcpy(st[2], &c, sizeof(v));					\
+	memcpy(st[3], &d, sizeof(v));
+
+typedef void (*md5mb_fn)(u32 (*st)[MD5MB_MAX], const u8 **p, i64 nblk);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD5MB_X86 1
+
+__attribute__((target("sse2")))
+static void
+md5mb_sse2(u32 (*st)[MD5MB_MAX], const u8 **p, i64 nblk)
+{
+	MD5MB_KERNEL(4)
+}
+
+__attribute__((target("avx2")))
+static void
+md5mb_avx2(u32 (*st)[MD5MB_MAX], const u8 **p, i64 nblk)
+{
+	MD5MB_KERNEL(8)
+}
+
+__attribute__((target("avx512f")))
+static void
+md5mb_avx512(u32 (*st)[MD5MB_MAX], const u8 **p, i64 nblk)
+{
+	MD5MB_KERNEL(16)
+}
+#endif
+
+/*\ Anywhere else, the compiler does what it can with 4 lanes \*/
+static void
+md5mb_generic(u32 (*st)[MD5MB_MAX], const u8 **p, i64 nblk)
+{
+	MD5MB_KERNEL(4)
+}
+
+static struct {
+	const char *name;
+	int lanes;
+	md5mb_fn fn;
+} mk = { "generic", 4, md5mb_generic };
+
+static pthread_once_t monce = PTHREAD_ONCE_INIT;
+
+/*\ Pick the widest kernel this CPU can run \*/
+static void
+mselect(void)
+{
+#ifdef MD5MB_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		mk.name = "avx512";
+		mk.lanes = 16;
+		mk.fn = md5mb_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		mk.name = "avx2";
+		mk.lanes = 8;
+		mk.fn = md5mb_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		mk.name = "sse2";
+		mk.lanes = 4;
+		mk.fn = md5mb_sse2;
+	}
+#endif
+	if (cmd.loglevel > 0)
+		fprintf(stderr, "MD5 kernel: %s, %d streams\n",
+				mk.name, mk.lanes);
+}
+
+int
+md5mb_lanes(void)
+{
+	pthread_once(&monce, mselect);
+	return mk.lanes;
+}
+
+void
+md5mb_blocks(struct md5_ctx **ctx, const u8 **p, int n, i64 nblk)
+{
+	u32 st[4][MD5MB_MAX];
+	const u8 *q[MD5MB_MAX];
+	u32 len;
+	int i, l, m;
+
+	if (nblk <= 0)
+		return;
+	pthread_once(&monce, mselect);
+	for (i = 0; i < n; i += m) {
+		m = n - i;
+		if (m > mk.lanes)
+			m = mk.lanes;
+		/*\ Unused lanes just do the first stream again \*/
+		for (l = 0; l < mk.lanes; l++) {
+			struct md5_ctx *c = ctx[i + ((l < m) ? l : 0)];
+
+			q[l] = p[i + ((l < m) ? l : 0)];
+			st[0][l] = c->A;
+			st[1][l] = c->B;
+			st[2][l] = c->C;
+			st[3][l] = c->D;
+		}
+		mk.fn(st, q, nblk);
+		for (l = 0; l < m; l++) {
+			struct md5_ctx *c = ctx[i + l];
+
+			c->A = st[0][l];
+			c->B = st[1][l];
+			c->C = st[2][l];
+			c->D = st[3][l];
+			/*\ Same byte count as md5_process_block() keeps \*/
+			len = nblk * 64;
+			c->total[0] += len;
+			if (c->total[0] < len)
+				c->total[1]++;
+			c->total[1] += (u64)nblk >> 26;
+		}
+	}
+}
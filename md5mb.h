@@ -0,0 +1,28 @@
+/*\
+|*|  Parity Archive - A way to restore missing files in a set.
+|*|
+|*|  Copyright (C) 2001  Willem Monsuwe (willem@stack.nl)
+|*|
+|*|  Multi-buffer MD5: several independent streams at once
+\*/
+
+#ifndef MD5MB_H
+#define MD5MB_H
+
+#include "types.h"
+#include "md5.h"
+
+/*\ Most streams that are ever done at once \*/
+#define MD5MB_MAX 16
+
+/*\ Number of streams that fit in the SIMD registers of this CPU \*/
+int md5mb_lanes(void);
+
+/*\ Run nblk 64-byte blocks of every one of n streams through its
+|*|  context.  The contexts must not have anything buffered, just like
+|*|  for md5_process_block().  n can be anything; it is done in groups
+|*|  of md5mb_lanes().
+\*/
+void md5mb_blocks(struct md5_ctx **ctx, const u8 **p, int n, i64 nblk);
+
+#endif
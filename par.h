@@ -61,6 +61,11 @@ extern struct cmdline {
 	int action;
 	int loglevel;
 	int volumes;	/*\ Number of volumes to create \*/
+	int threads;	/*\ Number of threads to use (0: one per CPU) \*/
+	int tile;	/*\ Tile size in KB (0: from cache size) \*/
+	int io;		/*\ How to read and write (IO_*) \*/
+	int align;	/*\ Start of the data in volumes (0: no padding) \*/
+	int sync;	/*\ 0: Don't sync, -1: at the end, n: every n MB too \*/
 
 	int pervol : 1;	/*\ volumes is actually files per volume \*/
 	int plus :1;	/*\ Turn on or off options (with + or -) \*/
@@ -73,6 +78,11 @@ extern struct cmdline {
 	int ctrl :1;	/*\ Check/create control hash \*/
 	int keep :1;	/*\ Keep broken files \*/
 	int smart :1;	/*\ Try to be smart about filenames \*/
+	int bitmat :1;	/*\ Use the XOR-only engine \*/
+	int repair :1;	/*\ Repair damaged files in place \*/
+	int direct :1;	/*\ Keep bulk reads and writes out of the cache \*/
+	int hdd :1;	/*\ Read big chunks in disk order \*/
+	int sparse :1;	/*\ Leave holes where only zeroes are written \*/
 	int dash :1;	/*\ End of cmdline switches \*/
 } cmd;
 
@@ -83,6 +93,12 @@ extern struct cmdline {
 #define ACTION_ADDING	12	/*\ ... and add files to it. \*/
 #define ACTION_TEXT_UI	20	/*\ Interactive text interface \*/
 
+#define IO_AUTO		0	/*\ io_uring if it works \*/
+#define IO_SYNC		1	/*\ Plain reads and writes \*/
+#define IO_URING	2	/*\ io_uring, complain if it doesn't work \*/
+#define IO_MMAP		3	/*\ Map the input files in \*/
+#define IO_THREADS	4	/*\ Reader and writer threads \*/
+
 #define PAR_MAGIC (*((i64 *)"PAR\0\0\0\0\0"))
 #define IS_PAR(x) (((x).magic) == PAR_MAGIC)
 
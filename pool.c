@@ -0,0 +1,166 @@
+/*\
+|*|  Parity Archive - A way to restore missing files in a set.
+|*|
+|*|  Copyright (C) 2001  Willem Monsuwe (willem@stack.nl)
+|*|
+|*|  Worker threads, to spread work over multiple processors.
+|*|   The threads are started on first use, and sleep in between jobs.
+\*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "pool.h"
+#include "par.h"
+
+static struct pool {
+	pthread_mutex_t owner;	/*\ Held by whoever is using the pool \*/
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	int nthreads;	/*\ Worker threads, not counting the caller \*/
+	u32 job;	/*\ Incremented for every job \*/
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int n, next, busy;
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	-1, 0, 0, 0, 0, 0, 0
+};
+
+int
+pool_size(void)
+{
+	long n;
+
+	if (cmd.threads > 0)
+		return cmd.threads;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+}
+
+/*\ Grab parts of the current job until there are none left.
+|*|  Called (and returns) with the lock held.
+\*/
+static void
+pool_work(void)
+{
+	int i;
+
+	while (pool.next < pool.n) {
+		i = pool.next++;
+		pool.busy++;
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(pool.arg, i);
+		pthread_mutex_lock(&pool.lock);
+		if (!--pool.busy && (pool.next >= pool.n))
+			pthread_cond_broadcast(&pool.done);
+	}
+}
+
+static void *
+pool_thread(void *dummy)
+{
+	u32 job = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.job == job)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		job = pool.job;
+		pool_work();
+	}
+	return 0;
+}
+
+static void
+pool_start(void)
+{
+	pthread_t t;
+	int i, n;
+
+	n = pool_size() - 1;
+	pool.nthreads = 0;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&t, 0, pool_thread, 0))
+			break;
+		pthread_detach(t);
+		pool.nthreads++;
+	}
+}
+
+void
+pool_run(void (*fn)(void *arg, int i), void *arg, int n)
+{
+	int i;
+
+	/*\ Not worth waking anyone up, or someone else has the pool \*/
+	if ((n <= 1) || pthread_mutex_trylock(&pool.owner)) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+	if (pool.nthreads < 0)
+		pool_start();
+	if (!pool.nthreads) {
+		pthread_mutex_unlock(&pool.owner);
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pool.busy = 0;
+	pool.job++;
+	pthread_cond_broadcast(&pool.wake);
+	pool_work();
+	while (pool.busy || (pool.next < pool.n))
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.owner);
+}
+
+struct spawn {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int i;
+};
+
+static void *
+spawn_thread(void *arg)
+{
+	struct spawn *sp = arg;
+
+	sp->fn(sp->arg, sp->i);
+	return 0;
+}
+
+void
+pool_spawn(void (*fn)(void *arg, int i), void *arg, int n)
+{
+	pthread_t *t;
+	struct spawn *sp;
+	int i;
+
+	NEW(t, n);
+	NEW(sp, n);
+	for (i = 0; i < n; i++) {
+		sp[i].fn = fn;
+		sp[i].arg = arg;
+		sp[i].i = i;
+		/*\ Can't start a thread ?  Do it ourselves. \*/
+		if (pthread_create(t + i, 0, spawn_thread, sp + i)) {
+			sp[i].fn = 0;
+			fn(arg, i);
+		}
+	}
+	for (i = 0; i < n; i++)
+		if (sp[i].fn)
+			pthread_join(t[i], 0);
+	free(t);
+	free(sp);
+}
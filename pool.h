@@ -0,0 +1,27 @@
+/*\
+|*|  Parity Archive - A way to restore missing files in a set.
+|*|
+|*|  Copyright (C) 2001  Willem Monsuwe (willem@stack.nl)
+|*|
+|*|  Worker threads, to spread work over multiple processors.
+\*/
+#ifndef POOL_H
+#define POOL_H
+
+#include "types.h"
+
+/*\ Number of threads that will be used (including the caller) \*/
+int pool_size(void);
+
+/*\ Call fn(arg, i) for every i from 0 to n-1, spread over the threads.
+|*|  Returns when all calls are done.
+|*|  If the pool is already in use, it's all done by the caller.
+\*/
+void pool_run(void (*fn)(void *arg, int i), void *arg, int n);
+
+/*\ Same, but every call gets a thread of its own.
+|*|  For jobs that spend most of their time waiting for the disk.
+\*/
+void pool_spawn(void (*fn)(void *arg, int i), void *arg, int n);
+
+#endif /* POOL_H */
@@ -11,11 +11,16 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "types.h"
 #include "fileops.h"
 #include "rs.h"
 #include "util.h"
 #include "par.h"
+#include "pool.h"
+#include "md5.h"
+#include "md5mb.h"
 
 /*\
 |*| Calculations over a Galois Field, GF(8)
@@ -64,238 +69,1959 @@ ginit(void)
 		ge[l] = ge[l - 0xff];
 }
 
+/*\
+|*| Calculations over GF(16), for sets with more than 255 files.
+|*|  A symbol is a 16-bit little-endian word instead of a byte.
+\*/
+
+static u16 *gl16, *ge16;
+
+static int
+gmul16(int a, int b)
+{
+	if ((a == 0) || (b == 0)) return 0;
+	return ge16[gl16[a] + gl16[b]];
+}
+
+static int
+gdiv16(int a, int b)
+{
+	if ((a == 0) || (b == 0)) return 0;
+	return ge16[gl16[a] - gl16[b] + 0xffff];
+}
+
+static int
+gpow16(int a, int b)
+{
+	if (a == 0) return 0;
+	return ge16[((i64)gl16[a] * b) % 0xffff];
+}
+
+/*\ Generator x^16 + x^12 + x^3 + x + 1 \*/
+static void
+ginit16(void)
+{
+	unsigned int b, l;
+
+	NEW(gl16, 0x10000);
+	NEW(ge16, 0x20000);
+	b = 1;
+	gl16[0] = 0;
+	for (l = 0; l < 0xffff; l++) {
+		gl16[b] = l;
+		ge16[l] = b;
+		b += b;
+		if (b & 0x10000) b ^= 0x1100b;
+	}
+	for (l = 0xffff; l < 0x20000; l++)
+		ge16[l] = ge16[l - 0xffff];
+}
+
+/*\ Either field: w is set for GF(16) \*/
+static int
+fmul(int w, int a, int b)
+{
+	return w ? gmul16(a, b) : gmul(a, b);
+}
+
+static int
+fdiv(int w, int a, int b)
+{
+	return w ? gdiv16(a, b) : gdiv(a, b);
+}
+
+static int
+fpow(int w, int a, int b)
+{
+	return w ? gpow16(a, b) : gpow(a, b);
+}
+
 /*\ Fill in a LUT \*/
 static void
-make_lut(u8 lut[0x100], int m)
+make_lut(u8 lut[0x100], int m)
+{
+	int j;
+	for (j = 0x100; --j; )
+		lut[j] = ge[gl[m] + gl[j]];
+	lut[0] = 0;
+}
+
+/*\
+|*| Multiply-accumulate kernels: p[q] ^= m * b[q]
+|*|  Every kernel works from the same precalculated tables,
+|*|  which are made once for every multiplier that's used.
+\*/
+
+typedef struct gmul_s gmul_t;
+
+struct gmul_s {
+	u8 lo[16];	/*\ m * (x & 0x0f) \*/
+	u8 hi[16];	/*\ m * (x & 0xf0) \*/
+	u64 aff;	/*\ 8x8 bit matrix for GF2P8AFFINEQB \*/
+	u8 lut[0x100];
+	/*\ GF(16) only \*/
+	u8 w[8][16];	/*\ Low, high byte of m * (nibble k of x) \*/
+	u64 waff[4];	/*\ Low<-low, low<-high, high<-low, high<-high \*/
+};
+
+/*\ Fill in all tables for multiplier m \*/
+static void
+make_gmul(gmul_t *t, int m)
+{
+	int i, j;
+	u64 row;
+
+	make_lut(t->lut, m);
+	for (j = 0; j < 16; j++) {
+		t->lo[j] = t->lut[j];
+		t->hi[j] = t->lut[j << 4];
+	}
+	/*\ Output bit i is the parity of (row i & x),
+	|*|  row i is stored in byte (7 - i) of the matrix
+	\*/
+	t->aff = 0;
+	for (i = 0; i < 8; i++) {
+		row = 0;
+		for (j = 0; j < 8; j++)
+			if (t->lut[1 << j] & (1 << i))
+				row |= 1 << j;
+		t->aff |= row << (8 * (7 - i));
+	}
+}
+
+static void
+muladd_lut(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	while (--n >= 0)
+		p[n] ^= t->lut[b[n]];
+}
+
+/*\ Fill in the GF(16) tables for multiplier m \*/
+static void
+make_gmul16(gmul_t *t, int m)
+{
+	int i, j, k, v;
+	u64 row;
+
+	for (k = 0; k < 4; k++) {
+		for (j = 0; j < 16; j++) {
+			v = gmul16(m, j << (4 * k));
+			t->w[2 * k][j] = v & 0xff;
+			t->w[2 * k + 1][j] = v >> 8;
+		}
+	}
+	/*\ Same as make_gmul(), for each 8x8 block of the 16x16 matrix \*/
+	for (k = 0; k < 4; k++) {
+		t->waff[k] = 0;
+		for (i = 0; i < 8; i++) {
+			row = 0;
+			for (j = 0; j < 8; j++) {
+				v = gmul16(m, 1 << (j + 8 * (k & 1)));
+				if (v & (1 << (i + 8 * (k >> 1))))
+					row |= 1 << j;
+			}
+			t->waff[k] |= row << (8 * (7 - i));
+		}
+	}
+}
+
+/*\ GF(16) kernels work on whole words, so n is even \*/
+static void
+muladd16_lut(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	int x;
+
+	for (; n >= 2; n -= 2, p += 2, b += 2) {
+		x = b[0] | (b[1] << 8);
+		p[0] ^= t->w[0][x & 0xf] ^ t->w[2][(x >> 4) & 0xf] ^
+			t->w[4][(x >> 8) & 0xf] ^ t->w[6][x >> 12];
+		p[1] ^= t->w[1][x & 0xf] ^ t->w[3][(x >> 4) & 0xf] ^
+			t->w[5][(x >> 8) & 0xf] ^ t->w[7][x >> 12];
+	}
+}
+
+/*\ Plain XOR, for multipliers of 1 \*/
+static void
+xor_u64(u8 *p, const u8 *b, i64 n)
+{
+	u64 x, y;
+
+	for (; n >= 8; n -= 8, p += 8, b += 8) {
+		memcpy(&x, b, 8);
+		memcpy(&y, p, 8);
+		y ^= x;
+		memcpy(p, &y, 8);
+	}
+	while (--n >= 0)
+		p[n] ^= b[n];
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GF_X86 1
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void
+xor_sse2(u8 *p, const u8 *b, i64 n)
+{
+	__m128i x;
+
+	for (; n >= 16; n -= 16, p += 16, b += 16) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)b),
+				_mm_loadu_si128((__m128i *)p));
+		_mm_storeu_si128((__m128i *)p, x);
+	}
+	xor_u64(p, b, n);
+}
+
+__attribute__((target("avx2")))
+static void
+xor_avx2(u8 *p, const u8 *b, i64 n)
+{
+	__m256i x;
+
+	for (; n >= 32; n -= 32, p += 32, b += 32) {
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)b),
+				_mm256_loadu_si256((__m256i *)p));
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	xor_u64(p, b, n);
+}
+
+__attribute__((target("avx512f")))
+static void
+xor_avx512(u8 *p, const u8 *b, i64 n)
+{
+	__m512i x;
+
+	for (; n >= 64; n -= 64, p += 64, b += 64) {
+		x = _mm512_xor_si512(_mm512_loadu_si512((const void *)b),
+				_mm512_loadu_si512((void *)p));
+		_mm512_storeu_si512((void *)p, x);
+	}
+	xor_u64(p, b, n);
+}
+
+__attribute__((target("ssse3")))
+static void
+muladd_ssse3(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m128i lo, hi, m, x, y;
+
+	lo = _mm_loadu_si128((const __m128i *)t->lo);
+	hi = _mm_loadu_si128((const __m128i *)t->hi);
+	m = _mm_set1_epi8(0x0f);
+	for (; n >= 16; n -= 16, p += 16, b += 16) {
+		x = _mm_loadu_si128((const __m128i *)b);
+		y = _mm_xor_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(x, m)),
+			_mm_shuffle_epi8(hi,
+				_mm_and_si128(_mm_srli_epi64(x, 4), m)));
+		y = _mm_xor_si128(y, _mm_loadu_si128((__m128i *)p));
+		_mm_storeu_si128((__m128i *)p, y);
+	}
+	muladd_lut(p, b, n, t);
+}
+
+__attribute__((target("avx2")))
+static void
+muladd_avx2(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m256i lo, hi, m, x, y;
+
+	lo = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)t->lo));
+	hi = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)t->hi));
+	m = _mm256_set1_epi8(0x0f);
+	for (; n >= 32; n -= 32, p += 32, b += 32) {
+		x = _mm256_loadu_si256((const __m256i *)b);
+		y = _mm256_xor_si256(
+			_mm256_shuffle_epi8(lo, _mm256_and_si256(x, m)),
+			_mm256_shuffle_epi8(hi,
+				_mm256_and_si256(_mm256_srli_epi64(x, 4), m)));
+		y = _mm256_xor_si256(y, _mm256_loadu_si256((__m256i *)p));
+		_mm256_storeu_si256((__m256i *)p, y);
+	}
+	muladd_lut(p, b, n, t);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+muladd_avx512(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m512i lo, hi, m, x, y;
+
+	lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)t->lo));
+	hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)t->hi));
+	m = _mm512_set1_epi8(0x0f);
+	for (; n >= 64; n -= 64, p += 64, b += 64) {
+		x = _mm512_loadu_si512((const void *)b);
+		y = _mm512_xor_si512(
+			_mm512_shuffle_epi8(lo, _mm512_and_si512(x, m)),
+			_mm512_shuffle_epi8(hi,
+				_mm512_and_si512(_mm512_srli_epi64(x, 4), m)));
+		y = _mm512_xor_si512(y, _mm512_loadu_si512((void *)p));
+		_mm512_storeu_si512((void *)p, y);
+	}
+	muladd_lut(p, b, n, t);
+}
+
+__attribute__((target("gfni,avx2")))
+static void
+muladd_gfni_avx2(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m256i a, x;
+
+	a = _mm256_set1_epi64x(t->aff);
+	for (; n >= 32; n -= 32, p += 32, b += 32) {
+		x = _mm256_loadu_si256((const __m256i *)b);
+		x = _mm256_gf2p8affine_epi64_epi8(x, a, 0);
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((__m256i *)p));
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	muladd_lut(p, b, n, t);
+}
+
+__attribute__((target("gfni,avx512f,avx512bw")))
+static void
+muladd_gfni_avx512(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m512i a, x;
+
+	a = _mm512_set1_epi64(t->aff);
+	for (; n >= 64; n -= 64, p += 64, b += 64) {
+		x = _mm512_loadu_si512((const void *)b);
+		x = _mm512_gf2p8affine_epi64_epi8(x, a, 0);
+		x = _mm512_xor_si512(x, _mm512_loadu_si512((void *)p));
+		_mm512_storeu_si512((void *)p, x);
+	}
+	muladd_lut(p, b, n, t);
+}
+
+/*\ GF(16): split every word into four nibbles, look up the low and
+|*|  high byte of the product of each, and put them back together.
+\*/
+__attribute__((target("avx2")))
+static void
+muladd16_avx2(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m256i tb[8], m, x, xl, xh, rl, rh;
+	int k;
+
+	for (k = 0; k < 8; k++)
+		tb[k] = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)t->w[k]));
+	m = _mm256_set1_epi16(0x000f);
+	for (; n >= 32; n -= 32, p += 32, b += 32) {
+		x = _mm256_loadu_si256((const __m256i *)b);
+		xl = _mm256_and_si256(x, m);
+		xh = _mm256_and_si256(_mm256_srli_epi16(x, 4), m);
+		rl = _mm256_xor_si256(_mm256_shuffle_epi8(tb[0], xl),
+				_mm256_shuffle_epi8(tb[2], xh));
+		rh = _mm256_xor_si256(_mm256_shuffle_epi8(tb[1], xl),
+				_mm256_shuffle_epi8(tb[3], xh));
+		xl = _mm256_and_si256(_mm256_srli_epi16(x, 8), m);
+		xh = _mm256_srli_epi16(x, 12);
+		rl = _mm256_xor_si256(rl, _mm256_xor_si256(
+				_mm256_shuffle_epi8(tb[4], xl),
+				_mm256_shuffle_epi8(tb[6], xh)));
+		rh = _mm256_xor_si256(rh, _mm256_xor_si256(
+				_mm256_shuffle_epi8(tb[5], xl),
+				_mm256_shuffle_epi8(tb[7], xh)));
+		x = _mm256_or_si256(rl, _mm256_slli_epi16(rh, 8));
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((__m256i *)p));
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	muladd16_lut(p, b, n, t);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+muladd16_avx512(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m512i tb[8], m, x, xl, xh, rl, rh;
+	int k;
+
+	for (k = 0; k < 8; k++)
+		tb[k] = _mm512_broadcast_i32x4(
+				_mm_loadu_si128((const __m128i *)t->w[k]));
+	m = _mm512_set1_epi16(0x000f);
+	for (; n >= 64; n -= 64, p += 64, b += 64) {
+		x = _mm512_loadu_si512((const void *)b);
+		xl = _mm512_and_si512(x, m);
+		xh = _mm512_and_si512(_mm512_srli_epi16(x, 4), m);
+		rl = _mm512_xor_si512(_mm512_shuffle_epi8(tb[0], xl),
+				_mm512_shuffle_epi8(tb[2], xh));
+		rh = _mm512_xor_si512(_mm512_shuffle_epi8(tb[1], xl),
+				_mm512_shuffle_epi8(tb[3], xh));
+		xl = _mm512_and_si512(_mm512_srli_epi16(x, 8), m);
+		xh = _mm512_srli_epi16(x, 12);
+		rl = _mm512_xor_si512(rl, _mm512_xor_si512(
+				_mm512_shuffle_epi8(tb[4], xl),
+				_mm512_shuffle_epi8(tb[6], xh)));
+		rh = _mm512_xor_si512(rh, _mm512_xor_si512(
+				_mm512_shuffle_epi8(tb[5], xl),
+				_mm512_shuffle_epi8(tb[7], xh)));
+		x = _mm512_or_si512(rl, _mm512_slli_epi16(rh, 8));
+		x = _mm512_xor_si512(x, _mm512_loadu_si512((void *)p));
+		_mm512_storeu_si512((void *)p, x);
+	}
+	muladd16_lut(p, b, n, t);
+}
+
+/*\ GF(16) with GFNI: the low byte of the product comes from
+|*|  the low byte times one block plus the high byte times another,
+|*|  so every word is also used with its bytes swapped.
+\*/
+__attribute__((target("gfni,avx2")))
+static void
+muladd16_gfni_avx2(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m256i a0, a1, a2, a3, m, x, xs, lo, hi;
+
+	a0 = _mm256_set1_epi64x(t->waff[0]);
+	a1 = _mm256_set1_epi64x(t->waff[1]);
+	a2 = _mm256_set1_epi64x(t->waff[2]);
+	a3 = _mm256_set1_epi64x(t->waff[3]);
+	m = _mm256_set1_epi16((short)0xff00);
+	for (; n >= 32; n -= 32, p += 32, b += 32) {
+		x = _mm256_loadu_si256((const __m256i *)b);
+		xs = _mm256_or_si256(_mm256_slli_epi16(x, 8),
+				_mm256_srli_epi16(x, 8));
+		lo = _mm256_xor_si256(_mm256_gf2p8affine_epi64_epi8(x, a0, 0),
+				_mm256_gf2p8affine_epi64_epi8(xs, a1, 0));
+		hi = _mm256_xor_si256(_mm256_gf2p8affine_epi64_epi8(xs, a2, 0),
+				_mm256_gf2p8affine_epi64_epi8(x, a3, 0));
+		x = _mm256_blendv_epi8(lo, hi, m);
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((__m256i *)p));
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	muladd16_lut(p, b, n, t);
+}
+
+__attribute__((target("gfni,avx512f,avx512bw")))
+static void
+muladd16_gfni_avx512(u8 *p, const u8 *b, i64 n, const gmul_t *t)
+{
+	__m512i a0, a1, a2, a3, x, xs, lo, hi;
+
+	a0 = _mm512_set1_epi64(t->waff[0]);
+	a1 = _mm512_set1_epi64(t->waff[1]);
+	a2 = _mm512_set1_epi64(t->waff[2]);
+	a3 = _mm512_set1_epi64(t->waff[3]);
+	for (; n >= 64; n -= 64, p += 64, b += 64) {
+		x = _mm512_loadu_si512((const void *)b);
+		xs = _mm512_or_si512(_mm512_slli_epi16(x, 8),
+				_mm512_srli_epi16(x, 8));
+		lo = _mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(x, a0, 0),
+				_mm512_gf2p8affine_epi64_epi8(xs, a1, 0));
+		hi = _mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(xs, a2, 0),
+				_mm512_gf2p8affine_epi64_epi8(x, a3, 0));
+		x = _mm512_mask_blend_epi8(0xaaaaaaaaaaaaaaaaULL, lo, hi);
+		x = _mm512_xor_si512(x, _mm512_loadu_si512((void *)p));
+		_mm512_storeu_si512((void *)p, x);
+	}
+	muladd16_lut(p, b, n, t);
+}
+#endif
+
+static struct gkernel {
+	const char *name;
+	void (*muladd)(u8 *p, const u8 *b, i64 n, const gmul_t *t);
+	const char *xname;
+	void (*xor)(u8 *p, const u8 *b, i64 n);
+	const char *wname;
+	void (*muladd16)(u8 *p, const u8 *b, i64 n, const gmul_t *t);
+} gk = { "lut", muladd_lut, "u64", xor_u64, "lut", muladd16_lut };
+
+/*\ Pick the fastest kernel this CPU can run \*/
+static void
+gselect(void)
+{
+#ifdef GF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("gfni") &&
+			__builtin_cpu_supports("avx512bw")) {
+		gk.name = gk.wname = "gfni-avx512";
+		gk.muladd = muladd_gfni_avx512;
+		gk.muladd16 = muladd16_gfni_avx512;
+	} else if (__builtin_cpu_supports("gfni") &&
+			__builtin_cpu_supports("avx2")) {
+		gk.name = gk.wname = "gfni-avx2";
+		gk.muladd = muladd_gfni_avx2;
+		gk.muladd16 = muladd16_gfni_avx2;
+	} else if (__builtin_cpu_supports("avx512bw")) {
+		gk.name = gk.wname = "avx512";
+		gk.muladd = muladd_avx512;
+		gk.muladd16 = muladd16_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		gk.name = gk.wname = "avx2";
+		gk.muladd = muladd_avx2;
+		gk.muladd16 = muladd16_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		gk.name = "ssse3";
+		gk.muladd = muladd_ssse3;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		gk.xname = "avx512";
+		gk.xor = xor_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		gk.xname = "avx2";
+		gk.xor = xor_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		gk.xname = "sse2";
+		gk.xor = xor_sse2;
+	}
+#endif
+}
+
+/*\ Tables and kernels are set up once, even with plans made
+|*|  in several threads at the same time.
+\*/
+static pthread_once_t gonce = PTHREAD_ONCE_INIT;
+static pthread_once_t gonce16 = PTHREAD_ONCE_INIT;
+
+static void
+gsetup(void)
+{
+	ginit();
+	gselect();
+}
+
+#define MT(i,j)     (mt[((i) * Q) + (j)])
+#define IMT(i,j)   (imt[((i) * N) + (j)])
+#define MULS(i,j) (muls[((i) * N) + (j)])
+
+/*\
+|*| XOR-only engine.
+|*|  Multiplying by a constant is linear over the bits, so it's an
+|*|  8x8 bit matrix.  If the bytes of a tile are split into 8 bit planes,
+|*|  every output plane is the XOR of a set of input planes.
+|*|  Pairs of planes that are XORed into several outputs are calculated
+|*|  only once, into temporary planes.
+\*/
+
+typedef struct bsched_s bsched_t;
+
+struct bsched_s {
+	int nin;	/*\ Input planes, 8 per input \*/
+	int ntmp;	/*\ Temporary planes \*/
+	int nout;	/*\ Output planes, 8 per output \*/
+	int nops;
+	struct bop {
+		int dst, src;	/*\ src < 0: clear dst \*/
+		int copy;	/*\ dst = src instead of dst ^= src \*/
+	} *ops;
+	u8 *used;	/*\ Inputs that are used at all \*/
+};
+
+#define BIT(v,i) (((v)[(i) >> 6] >> ((i) & 63)) & 1)
+#define SETBIT(v,i) ((v)[(i) >> 6] |= ((u64)1 << ((i) & 63)))
+#define CLRBIT(v,i) ((v)[(i) >> 6] &= ~((u64)1 << ((i) & 63)))
+
+static int
+popcount64(u64 x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	int n;
+	for (n = 0; x; n++)
+		x &= x - 1;
+	return n;
+#endif
+}
+
+/*\ Turn the multipliers into a list of plane XORs \*/
+static bsched_t *
+make_bsched(u16 *muls, int M, int N)
+{
+	bsched_t *bs;
+	int R, S, maxtmp, RW, SW;
+	int i, j, k, r, a, b, ba, bb, best, n, nops;
+	u64 *rows, *cols, *both;
+	i64 budget;
+	u8 lut[0x100];
+
+	R = M * 8;
+	maxtmp = N * 8;
+	if (maxtmp > 0x1000) maxtmp = 0x1000;
+	S = N * 8 + maxtmp;
+	RW = (R + 63) / 64;
+	SW = (S + 63) / 64;
+	CNEW(rows, R * SW);
+	CNEW(cols, S * RW);
+	CNEW(both, RW);
+	CNEW(bs, 1);
+	CNEW(bs->used, N);
+	bs->nin = N * 8;
+	bs->nout = R;
+
+	/*\ Output bit r of m*x has input bit k if bit r of m*(1<<k) is set \*/
+	for (j = 0; j < M; j++) {
+		for (i = 0; i < N; i++) {
+			if (!MULS(j, i)) continue;
+			make_lut(lut, MULS(j, i));
+			bs->used[i] = 1;
+			for (r = 0; r < 8; r++)
+				for (k = 0; k < 8; k++)
+					if (lut[1 << k] & (1 << r)) {
+						SETBIT(rows + (j * 8 + r) * SW,
+							i * 8 + k);
+						SETBIT(cols + (i * 8 + k) * RW,
+							j * 8 + r);
+					}
+		}
+	}
+
+	/*\ Common subexpressions: keep replacing the pair of planes that
+	|*|  occurs in most rows by a temporary, until no pair is shared.
+	|*|  The budget keeps this from taking ages on huge sets.
+	\*/
+	NEW(bs->ops, 2 * maxtmp + R * (S + 1));
+	nops = 0;
+	budget = 1 << 24;
+	for (n = N * 8; (n < S) && (budget > 0); n++) {
+		best = 1;
+		ba = bb = -1;
+		for (a = 0; a < n; a++) {
+			for (b = a + 1; b < n; b++) {
+				for (r = k = 0; r < RW; r++)
+					k += popcount64(cols[a * RW + r] &
+							cols[b * RW + r]);
+				if (k > best) {
+					best = k;
+					ba = a;
+					bb = b;
+				}
+			}
+			budget -= (n - a) * RW;
+		}
+		if (ba < 0)
+			break;
+		for (r = 0; r < RW; r++) {
+			both[r] = cols[ba * RW + r] & cols[bb * RW + r];
+			cols[ba * RW + r] &= ~both[r];
+			cols[bb * RW + r] &= ~both[r];
+			cols[n * RW + r] = both[r];
+		}
+		for (r = 0; r < R; r++) {
+			if (!BIT(both, r)) continue;
+			CLRBIT(rows + r * SW, ba);
+			CLRBIT(rows + r * SW, bb);
+			SETBIT(rows + r * SW, n);
+		}
+		bs->ops[nops].dst = n;
+		bs->ops[nops].src = ba;
+		bs->ops[nops++].copy = 1;
+		bs->ops[nops].dst = n;
+		bs->ops[nops].src = bb;
+		bs->ops[nops++].copy = 0;
+	}
+	bs->ntmp = n - N * 8;
+
+	/*\ And the output rows themselves \*/
+	for (r = 0; r < R; r++) {
+		k = 1;
+		for (a = 0; a < n; a++) {
+			if (!BIT(rows + r * SW, a)) continue;
+			bs->ops[nops].dst = n + r;
+			bs->ops[nops].src = a;
+			bs->ops[nops++].copy = k;
+			k = 0;
+		}
+		if (k) {
+			bs->ops[nops].dst = n + r;
+			bs->ops[nops].src = -1;
+			bs->ops[nops++].copy = 1;
+		}
+	}
+	bs->nops = nops;
+
+	free(rows);
+	free(cols);
+	free(both);
+	return bs;
+}
+
+static void
+free_bsched(bsched_t *bs)
+{
+	if (!bs) return;
+	free(bs->ops);
+	free(bs->used);
+	free(bs);
+}
+
+/*\ Transpose an 8x8 bit matrix, byte i being row i \*/
+static u64
+transpose8(u64 x)
+{
+	u64 t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x ^= t ^ (t << 28);
+	return x;
+}
+
+static u64
+load64(const u8 *b)
+{
+	return ((u64)b[0]) | ((u64)b[1] << 8) | ((u64)b[2] << 16) |
+		((u64)b[3] << 24) | ((u64)b[4] << 32) | ((u64)b[5] << 40) |
+		((u64)b[6] << 48) | ((u64)b[7] << 56);
+}
+
+static void
+store64(u8 *b, u64 x)
+{
+	int i;
+	for (i = 0; i < 8; i++, x >>= 8)
+		b[i] = x;
+}
+
+/*\ Split n bytes (zero padded to 8 * P) into 8 planes of P bytes \*/
+static void
+bitslice(u8 *planes, i64 P, const u8 *b, i64 n)
+{
+	i64 g;
+	u64 x;
+	u8 tmp[8];
+	int k;
+
+	for (g = 0; g < P; g++, b += 8, n -= 8) {
+		if (n >= 8) {
+			x = load64(b);
+		} else if (n > 0) {
+			memset(tmp, 0, 8);
+			memcpy(tmp, b, n);
+			x = load64(tmp);
+		} else {
+			x = 0;
+		}
+		x = transpose8(x);
+		for (k = 0; k < 8; k++, x >>= 8)
+			planes[k * P + g] = x;
+	}
+}
+
+/*\ Join 8 planes of P bytes back into 8 * P bytes \*/
+static void
+unbitslice(u8 *b, const u8 *planes, i64 P)
+{
+	i64 g;
+	u64 x;
+	int k;
+
+	for (g = 0; g < P; g++, b += 8) {
+		x = 0;
+		for (k = 8; --k >= 0; )
+			x = (x << 8) | planes[k * P + g];
+		store64(b, transpose8(x));
+	}
+}
+
+/*\ Run the schedule over P-byte planes \*/
+static void
+run_bsched(bsched_t *bs, u8 *planes, i64 P)
+{
+	struct bop *op;
+	int i;
+
+	for (i = 0, op = bs->ops; i < bs->nops; i++, op++) {
+		if (op->src < 0)
+			memset(planes + op->dst * P, 0, P);
+		else if (op->copy)
+			memcpy(planes + op->dst * P, planes + op->src * P, P);
+		else
+			gk.xor(planes + op->dst * P, planes + op->src * P, P);
+	}
+}
+
+/*\ Bytes read from every file in one go \*/
+#define STRIPE 0x10000
+
+/*\ Pick a tile size so one input tile and M output tiles
+|*|  fit in half of the L2 cache, unless the user knows better.
+\*/
+static i64
+tile_size(int M)
+{
+	i64 c = 0, t;
+
+	if (cmd.tile > 0) {
+		t = (i64)cmd.tile << 10;
+	} else {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		c = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		if (c <= 0)
+			c = 0x40000;
+		t = (c / 2) / (M + 1);
+	}
+	t &= ~0x3ff;
+	if (t < 0x400) t = 0x400;
+	if (t > STRIPE) t = STRIPE;
+	return t;
+}
+
+/*\
+|*| Only volume 1 is involved, either as the only output volumes,
+|*|  or as the only input volume to restore a single file.
+|*|  Its row is all ones, so it's a plain XOR of all the other files.
+|*|  Returns 0 if that's not the case.
+\*/
+static int
+xor_only(xfile_t *in, xfile_t *out, u16 *muls, u8 *ok, int M, int N)
+{
+	int i, j, k, v, found;
+
+	for (i = 0, v = -1; in[i].filenr; i++) {
+		if (!in[i].files)
+			continue;
+		if ((in[i].filenr != 1) || (v >= 0))
+			return 0;
+		v = i;
+	}
+	if (v < 0) {
+		/*\ Making volume 1 out of data files \*/
+		for (j = 0; out[j].filenr; j++) {
+			if (!out[j].files || (out[j].filenr != 1))
+				return 0;
+			for (k = 0; out[j].files[k]; k++) {
+				for (i = 0; in[i].filenr; i++)
+					if (in[i].filenr == out[j].files[k])
+						break;
+				if (!in[i].filenr)
+					return 0;
+				MULS(j, i) = 1;
+			}
+		}
+	} else {
+		/*\ Restoring a single data file from volume 1 \*/
+		if ((M != 1) || out[0].files)
+			return 0;
+		/*\ Rather copy what's left of the file itself \*/
+		for (i = 0; in[i].filenr; i++)
+			if (!in[i].files && (in[i].filenr == out[0].filenr))
+				return 0;
+		found = 0;
+		for (k = 0; in[v].files[k]; k++) {
+			if (in[v].files[k] == out[0].filenr) {
+				found = 1;
+				continue;
+			}
+			for (i = 0; in[i].filenr; i++)
+				if (!in[i].files &&
+					(in[i].filenr == in[v].files[k]))
+					break;
+			if (!in[i].filenr)
+				return 0;
+			MULS(0, i) = 1;
+		}
+		if (!found)
+			return 0;
+		MULS(0, v) = 1;
+	}
+	for (j = 0; j < M; j++)
+		ok[j] = 1;
+	return 1;
+}
+
+/*\
+|*| Do gaussian elimination on the matrix of all input and output rows,
+|*|  and fill in the multipliers from the inverse.
+\*/
+static void
+gauss(xfile_t *in, xfile_t *out, u16 *muls, u8 *ok, int M, int N, int Q, int R,
+		int w)
+{
+	int i, j, k, l, *col;
+	u16 *mt, *imt;
+
+	CNEW(mt, R * Q);
+	CNEW(imt, R * N);
+	NEW(col, M);
+
+	/*\ Fill in matrix rows for recovery files \*/
+	for (i = j = 0; in[i].filenr; i++) {
+		if (!in[i].files)
+			continue;
+		for (k = 0; in[i].files[k]; k++)
+			MT(j, in[i].files[k]-1) =
+				fpow(w, k+1, in[i].filenr - 1);
+		IMT(j, i) = 1;
+		j++;
+	}
+
+	/*\ Fill in matrix rows for output recovery files \*/
+	for (i = 0, l = Q; out[i].filenr; i++) {
+		col[i] = out[i].filenr - 1;
+		if (!out[i].files)
+			continue;
+		for (k = 0; out[i].files[k]; k++)
+			MT(j, out[i].files[k]-1) =
+				fpow(w, k+1, out[i].filenr - 1);
+		--l;
+		/*\ The output volume gets its own column \*/
+		col[i] = l;
+		MT(j, l) = 1;
+		j++;
+	}
+
+	/*\ Use (virtual) rows from data files to eliminate columns \*/
+	for (i = 0; in[i].filenr; i++) {
+		if (in[i].files)
+			continue;
+		k = in[i].filenr - 1;
+		/*\ MT would have a 1 at (i, k), IMT a 1 at (i, i)
+		|*| IMT(j,i) -= MT(j,k) * IMT(i,i)  (is MT(j, k))
+		|*|  MT(j,k) -= MT(j,k) *  MT(i,k)  (becomes 0)
+		\*/
+		for (j = 0; j < R; j++) {
+			IMT(j, i) ^= MT(j, k);
+			MT(j, k) = 0;
+		}
+	}
+
+	/*\ Eliminate columns using the remaining rows, so we get I.
+	|*| The accompanying matrix will be the inverse
+	\*/
+	for (i = 0; i < R; i++) {
+		int d, l;
+		/*\ Find first non-zero entry \*/
+		for (l = 0; (l < Q) && !MT(i, l); l++)
+			;
+		if (l == Q) continue;
+		d = MT(i, l);
+		/*\ Scale the matrix so MT(i, l) becomes 1 \*/
+		for (j = 0; j < Q; j++)
+			MT(i, j) = fdiv(w, MT(i, j), d);
+		for (j = 0; j < N; j++)
+			IMT(i, j) = fdiv(w, IMT(i, j), d);
+		/*\ Eliminate the column in the other matrices \*/
+		for (k = 0; k < R; k++) {
+			if (k == i) continue;
+			d = MT(k, l);
+			for (j = 0; j < Q; j++)
+				MT(k, j) ^= fmul(w, MT(i, j), d);
+			for (j = 0; j < N; j++)
+				IMT(k, j) ^= fmul(w, IMT(i, j), d);
+		}
+	}
+
+	/*\ Make the multiplication tables \*/
+	for (i = 0; out[i].filenr; i++) {
+		/*\ A (partial) copy of the file is one of the inputs \*/
+		if (!out[i].files) {
+			for (k = 0; k < N; k++)
+				if (!in[k].files &&
+					(in[k].filenr == out[i].filenr))
+					break;
+			if (k < N) {
+				MULS(i, k) = 1;
+				ok[i] = 1;
+				continue;
+			}
+		}
+		/*\ File #x: The row IMT(j) for which MT(j,x) = 1 \*/
+		for (j = 0; j < R; j++) {
+			k = col[i];
+			if (MT(j, k) != 1)
+				continue;
+			/*\ All other values should be 0 \*/
+			for (k = 0; !MT(j, k); k++)
+				;
+			if (k != col[i])
+				continue;
+			for (k++; (k < Q) && !MT(j, k); k++)
+				;
+			if (k != Q)
+				continue;
+			break;
+		}
+		/*\ Did we find a suitable row ? \*/
+		if (j == R)
+			continue;
+		ok[i] = 1;
+		for (k = 0; k < N; k++)
+			MULS(i, k) = IMT(j, k);
+	}
+	free(mt);
+	free(imt);
+	free(col);
+}
+
+/*\
+|*| Coding plans
+\*/
+
+struct rs_plan_s {
+	int M, N;
+	int wide;	/*\ Coding over GF(16) \*/
+	u16 *muls;	/*\ Multiplier for every output/input pair \*/
+	int xor1;	/*\ Only volume 1, so plain XOR \*/
+	gmul_t *tabs;	/*\ Precalculated tables for the multipliers \*/
+	u8 *ok;		/*\ Outputs that can be made \*/
+	u8 *used;	/*\ Inputs that are needed \*/
+	i64 tile;	/*\ Number of bytes calculated in one go \*/
+	bsched_t *bs;	/*\ XOR schedule, for the XOR-only engine \*/
+};
+
+rs_plan_t *
+rs_plan(xfile_t *in, xfile_t *out)
+{
+	int i, j, k, M, N, Q, R, w;
+	rs_plan_t *pl;
+	u16 *muls;
+
+	pthread_once(&gonce, gsetup);
+
+	/*\ Count number of recovery files \*/
+	for (i = Q = R = w = 0; in[i].filenr; i++) {
+		if (in[i].files) {
+			R++;
+			/*\ Get max. matrix row size \*/
+			for (k = 0; in[i].files[k]; k++) {
+				if (in[i].files[k] > Q)
+					Q = in[i].files[k];
+			}
+			if (RS_WIDE(k, in[i].filenr))
+				w = 1;
+		} else {
+			if (in[i].filenr > Q)
+				Q = in[i].filenr;
+		}
+	}
+	N = i;
+
+	/*\ Count number of volumes to output \*/
+	for (i = j = M = 0; out[i].filenr; i++) {
+		M++;
+		if (out[i].files) {
+			j++;
+			/*\ Get max. matrix row size \*/
+			for (k = 0; out[i].files[k]; k++) {
+				if (out[i].files[k] > Q)
+					Q = out[i].files[k];
+			}
+			if (RS_WIDE(k, out[i].filenr))
+				w = 1;
+		} else {
+			if (out[i].filenr > Q)
+				Q = out[i].filenr;
+		}
+	}
+	R += j;
+	Q += j;
+
+	if (w)
+		pthread_once(&gonce16, ginit16);
+
+	CNEW(pl, 1);
+	pl->M = M;
+	pl->N = N;
+	pl->wide = w;
+	CNEW(pl->ok, M);
+	CNEW(pl->used, N);
+
+	/*\ Work out which multiple of which input goes into which output \*/
+	CNEW(muls, M * N);
+	pl->muls = muls;
+	pl->xor1 = xor_only(in, out, muls, pl->ok, M, N);
+	if (!pl->xor1) {
+		memset(muls, 0, M * N * sizeof(*muls));
+		gauss(in, out, muls, pl->ok, M, N, Q, R, w);
+		/*\ Plain XOR doesn't get any faster with bit planes,
+		|*|  and the bit planes are only done for GF(8)
+		\*/
+		if (cmd.bitmat && !w)
+			pl->bs = make_bsched(muls, M, N);
+	}
+
+	/*\ Check for columns with all-zeroes \*/
+	for (j = 0; j < N; j++)
+		for (i = 0; i < M; i++)
+			if (MULS(i, j))
+				pl->used[j] = 1;
+
+	/*\ Precalc the tables for every multiplier, once \*/
+	NEW(pl->tabs, M * N);
+	for (i = 0; i < M; i++)
+		for (j = 0; j < N; j++)
+			if ((MULS(i, j) > 1) && w)
+				make_gmul16(pl->tabs + (i * N) + j, MULS(i, j));
+			else if (MULS(i, j) > 1)
+				make_gmul(pl->tabs + (i * N) + j, MULS(i, j));
+
+	pl->tile = tile_size(M);
+	return pl;
+}
+
+int
+rs_plan_ok(rs_plan_t *pl, int j)
+{
+	return pl->ok[j];
+}
+
+int
+rs_plan_used(rs_plan_t *pl, int i)
+{
+	return pl->used[i];
+}
+
+/*\ Which kernels were picked, shown once \*/
+static pthread_once_t konce = PTHREAD_ONCE_INIT;
+
+static void
+kernel_log(void)
+{
+	fprintf(stderr, "GF kernel: %s, GF(16) kernel: %s, XOR kernel: %s\n",
+			gk.name, gk.wname, gk.xname);
+}
+
+/*\ Show what a new plan does, with -v.
+|*|  rs_plan() doesn't print anything itself, its callers do this.
+\*/
+static void
+plan_log(rs_plan_t *pl)
+{
+	u16 *muls = pl->muls;
+	int i, j, N = pl->N;
+
+	if (cmd.loglevel <= 0)
+		return;
+	pthread_once(&konce, kernel_log);
+	if (pl->xor1)
+		fprintf(stderr, "Volume 1 only: using plain XOR\n");
+	if (pl->bs)
+		fprintf(stderr, "XOR schedule: %d temporaries, %d operations\n",
+				pl->bs->ntmp, pl->bs->nops);
+	fprintf(stderr, "Multipliers:\n");
+	for (i = 0; i < pl->M; i++) {
+		fprintf(stderr, "| ");
+		for (j = 0; j < N; j++)
+			fprintf(stderr, "%02x ", MULS(i, j));
+		fprintf(stderr, "|\n");
+	}
+	fprintf(stderr, "Tile size: %lld bytes\n", pl->tile);
+}
+
+void
+rs_plan_free(rs_plan_t *pl)
+{
+	if (!pl) return;
+	free_bsched(pl->bs);
+	free(pl->muls);
+	free(pl->tabs);
+	free(pl->ok);
+	free(pl->used);
+	free(pl);
+}
+
+/*\ GF(16) multiply-accumulate of bytes t to o of b into p.
+|*|  A file of odd length ends in half a word: b has n bytes,
+|*|  p has pn bytes, the rest counts as zero.
+\*/
+static void
+muladd_wide(u8 *p, i64 pn, const u8 *b, i64 n, i64 t, i64 o, int m,
+		const gmul_t *tab)
+{
+	int x;
+
+	gk.muladd16(p + t, b + t, (o - t) & ~1, tab);
+	if (!((o - t) & 1))
+		return;
+	o--;
+	x = b[o];
+	if (o + 1 < n)
+		x |= b[o + 1] << 8;
+	x = gmul16(m, x);
+	p[o] ^= x & 0xff;
+	if (o + 1 < pn)
+		p[o + 1] ^= x >> 8;
+}
+
+/*\ out[j] = sum of MULS(j, i) * in[i] over the first outlen[j] bytes.
+|*|  Inputs count as zero past inlen[i], missing buffers are skipped.
+\*/
+static void
+plan_run(rs_plan_t *pl, u8 *const *in, const i64 *inlen,
+		u8 *const *out, const i64 *outlen)
+{
+	u16 *muls = pl->muls;
+	int i, j, N = pl->N;
+	i64 len, t, e, n, o;
+
+	for (len = 0, j = 0; j < pl->M; j++)
+		if (out[j] && (outlen[j] > len))
+			len = outlen[j];
+	for (t = 0; t < len; t = e) {
+		e = t + pl->tile;
+		if (e > len) e = len;
+		for (j = 0; j < pl->M; j++) {
+			if (!out[j] || (outlen[j] <= t)) continue;
+			o = (outlen[j] < e) ? outlen[j] : e;
+			memset(out[j] + t, 0, o - t);
+		}
+		for (i = 0; i < N; i++) {
+			if (!pl->used[i] || !in[i]) continue;
+			n = inlen[i];
+			if (n > e) n = e;
+			if (n <= t) continue;
+			for (j = 0; j < pl->M; j++) {
+				if (!out[j] || !MULS(j, i)) continue;
+				o = (outlen[j] < n) ? outlen[j] : n;
+				if (o <= t) continue;
+				/*\ XOR it in, multiplied by MULS(j, i) \*/
+				if (MULS(j, i) == 1)
+					gk.xor(out[j] + t, in[i] + t, o - t);
+				else if (!pl->wide)
+					gk.muladd(out[j] + t, in[i] + t, o - t,
+						pl->tabs + (j * N) + i);
+				else
+					muladd_wide(out[j], outlen[j], in[i],
+						inlen[i], t, o, MULS(j, i),
+						pl->tabs + (j * N) + i);
+			}
+		}
+	}
+}
+
+void
+rs_apply(rs_plan_t *pl, u8 **in, u8 **out, i64 len)
+{
+	i64 *inlen, *outlen;
+	int i;
+
+	NEW(inlen, pl->N);
+	NEW(outlen, pl->M);
+	for (i = 0; i < pl->N; i++)
+		inlen[i] = len;
+	for (i = 0; i < pl->M; i++)
+		outlen[i] = len;
+	plan_run(pl, in, inlen, out, outlen);
+	free(inlen);
+	free(outlen);
+}
+
+void
+rs_apply_iov(rs_plan_t *pl, const struct iovec *in, const struct iovec *out)
+{
+	u8 **ib, **ob;
+	i64 *inlen, *outlen;
+	int i;
+
+	NEW(ib, pl->N);
+	NEW(inlen, pl->N);
+	NEW(ob, pl->M);
+	NEW(outlen, pl->M);
+	for (i = 0; i < pl->N; i++) {
+		ib[i] = in[i].iov_base;
+		inlen[i] = in[i].iov_len;
+	}
+	for (i = 0; i < pl->M; i++) {
+		ob[i] = out[i].iov_base;
+		outlen[i] = out[i].iov_len;
+	}
+	plan_run(pl, ib, inlen, ob, outlen);
+	free(ib);
+	free(inlen);
+	free(ob);
+	free(outlen);
+}
+
+/*\
+|*| Recreate files from files
+\*/
+
+/*\ Is this buffer all zeroes ? \*/
+static int
+is_zero(const u8 *b, i64 n)
+{
+	u64 x = 0;
+	i64 i;
+
+	for (i = 0; (i + 8) <= n; i += 8)
+		x |= load64(b + i);
+	for (; i < n; i++)
+		x |= b[i];
+	return !x;
+}
+
+
+/*\ The stripe that's being worked on \*/
+struct stripe {
+	xfile_t *in, *out;
+	rs_plan_t *pl;	/*\ Plan for this stripe \*/
+	int *map;	/*\ Input number in the plan -> input number \*/
+	i64 s;		/*\ Offset of the stripe in the files \*/
+	i64 chunk;	/*\ Size of the stripe \*/
+	int *order;	/*\ Order to read the inputs in \*/
+	u8 *ibuf;	/*\ One chunk for every input \*/
+	u8 **ip;	/*\ Where the data of every input is \*/
+	i64 *len;	/*\ Number of bytes read for every input \*/
+	u8 *work;	/*\ One chunk for every output \*/
+	int parts;	/*\ Number of pieces the stripe is cut into \*/
+	u8 **planes;	/*\ Bit planes for every part \*/
+	i64 *psize;	/*\ Size of the bit planes buffers \*/
+	struct pcache *pc;	/*\ Plan for the inputs read so far \*/
+	u8 *dead;	/*\ Inputs that can't be used \*/
+	u8 *rerr;	/*\ Inputs a read error was shown for, in any stripe \*/
+	u8 *got;	/*\ 1: read queued, 2: read done, 3: to be mapped \*/
+	i64 *res;	/*\ Result of the read of every input \*/
+	i64 *wres;	/*\ Result of the write of every output \*/
+	i64 *wlen;	/*\ Bytes written to every output \*/
+};
+
+/*\ Calculate one tile of all outputs with the XOR-only engine \*/
+static void
+stripe_tile_xor(struct stripe *st, int part, i64 t, i64 e)
+{
+	bsched_t *bs = st->pl->bs;
+	u8 *planes;
+	i64 P = (e - t) / 8, n;
+	int i, j;
+
+	/*\ Plans for other stripes may have needed fewer planes \*/
+	n = (bs->nin + bs->ntmp + bs->nout) * (st->pl->tile / 8);
+	if (st->psize[part] < n) {
+		RENEW(st->planes[part], n);
+		st->psize[part] = n;
+	}
+	planes = st->planes[part];
+	for (i = 0; i < st->pl->N; i++) {
+		if (!bs->used[i]) continue;
+		n = st->len[st->map[i]] - t;
+		if (n > e - t) n = e - t;
+		bitslice(planes + i * 8 * P, P,
+			st->ip[st->map[i]] + t, n);
+	}
+	run_bsched(bs, planes, P);
+	planes += (bs->nin + bs->ntmp) * P;
+	for (j = 0; st->out[j].filenr; j++) {
+		if (st->s >= st->out[j].size) continue;
+		unbitslice(st->work + (j * st->chunk) + t, planes + j * 8 * P, P);
+	}
+}
+
+/*\ Calculate one piece of the stripe, for all outputs. \*/
+static void
+stripe_part(void *arg, int part)
+{
+	struct stripe *st = arg;
+	rs_plan_t *pl = st->pl;
+	u8 **ib, **ob;
+	i64 *inlen, *outlen;
+	i64 a, b, t, e;
+	int i, j;
+
+	/*\ Keep the pieces cache line aligned \*/
+	a = ((st->chunk / st->parts) * part) & ~0x3f;
+	b = ((st->chunk / st->parts) * (part + 1)) & ~0x3f;
+	if (part == st->parts - 1)
+		b = st->chunk;
+	if (pl->bs) {
+		for (t = a; t < b; t = e) {
+			e = t + pl->tile;
+			if (e > b) e = b;
+			stripe_tile_xor(st, part, t, e);
+		}
+		return;
+	}
+	NEW(ib, pl->N);
+	NEW(inlen, pl->N);
+	NEW(ob, pl->M);
+	NEW(outlen, pl->M);
+	for (i = 0; i < pl->N; i++) {
+		ib[i] = st->ip[st->map[i]] + a;
+		inlen[i] = st->len[st->map[i]] - a;
+	}
+	for (j = 0; j < pl->M; j++) {
+		ob[j] = 0;
+		if (st->s >= st->out[j].size) continue;
+		ob[j] = st->work + (j * st->chunk) + a;
+		outlen[j] = b - a;
+	}
+	plan_run(pl, ib, inlen, ob, outlen);
+	free(ib);
+	free(inlen);
+	free(ob);
+	free(outlen);
+}
+
+/*\
+|*| Every stripe can have its own set of missing inputs,
+|*|  because of read errors or files that are cut short.
+|*|  Keep a plan for every set that's been seen.
+\*/
+struct pcache {
+	struct pcache *next;
+	u8 *dead;	/*\ Inputs that can't be used \*/
+	int *map;	/*\ Input number in the plan -> input number \*/
+	int *inv;	/*\ Input number -> input number in the plan, or -1 \*/
+	rs_plan_t *pl;
+};
+
+static struct pcache *
+find_plan(struct pcache **cache, xfile_t *in, xfile_t *out, u8 *dead, int N)
+{
+	struct pcache *pc;
+	xfile_t *sub;
+	int i, n;
+
+	for (pc = *cache; pc; pc = pc->next)
+		if (!memcmp(pc->dead, dead, N))
+			return pc;
+	CNEW(pc, 1);
+	NEW(pc->dead, N);
+	COPY(pc->dead, dead, N);
+	NEW(pc->map, N);
+	NEW(pc->inv, N);
+	NEW(sub, N + 1);
+	for (i = n = 0; i < N; i++) {
+		pc->inv[i] = -1;
+		if (dead[i]) continue;
+		sub[n] = in[i];
+		pc->inv[i] = n;
+		pc->map[n++] = i;
+	}
+	sub[n].filenr = 0;
+	pc->pl = rs_plan(sub, out);
+	plan_log(pc->pl);
+	free(sub);
+	pc->next = *cache;
+	*cache = pc;
+	return pc;
+}
+
+static void
+free_pcache(struct pcache *pc)
 {
-	int j;
-	for (j = 0x100; --j; )
-		lut[j] = ge[gl[m] + gl[j]];
-	lut[0] = 0;
+	struct pcache *next;
+
+	for (; pc; pc = next) {
+		next = pc->next;
+		rs_plan_free(pc->pl);
+		free(pc->dead);
+		free(pc->map);
+		free(pc->inv);
+		free(pc);
+	}
 }
 
-#define MT(i,j)     (mt[((i) * Q) + (j)])
-#define IMT(i,j)   (imt[((i) * N) + (j)])
-#define MULS(i,j) (muls[((i) * N) + (j)])
+/*\ Queue the reads of this stripe for every input the plan needs \*/
+static struct pcache *
+queue_reads(struct stripe *st, struct pcache **cache, fqueue_t *q,
+		i64 *base, int N)
+{
+	struct pcache *pc;
+	xfile_t *in = st->in;
+	i64 tr, s = st->s;
+	int i, k, o;
 
-int
-recreate(xfile_t *in, xfile_t *out)
+	pc = find_plan(cache, in, st->out, st->dead, N);
+	for (o = 0; o < N; o++) {
+		i = st->order[o];
+		k = pc->inv[i];
+		if ((k < 0) || st->got[i] || !rs_plan_used(pc->pl, k))
+			continue;
+		st->got[i] = 2;
+		tr = st->chunk;
+		if (tr > (in[i].size - s))
+			tr = in[i].size - s;
+		if (tr <= 0)
+			continue;
+		/*\ Holes count as zeroes, just like the end of a file \*/
+		if (file_zero(in[i].f, base[i] + s, tr))
+			continue;
+		if (cmd.io == IO_MMAP) {
+			/*\ Mapped in just before it's used \*/
+			st->got[i] = 3;
+			continue;
+		}
+		st->got[i] = 1;
+		fq_read(q, in[i].f, st->ibuf + (i * st->chunk), tr,
+				base[i] + s, &st->res[i]);
+	}
+	return pc;
+}
+
+/*\ Start reading the stripe at offset s \*/
+static void
+read_start(struct stripe *st, struct pcache **cache, fqueue_t *q,
+		i64 *base, int N, i64 s)
 {
-	int i, j, k, l, M, N, Q, R;
-	u8 *mt, *imt, *muls;
-	u8 buf[0x10000], *work;
-	i64 s, size;
-	i64 perc;
+	xfile_t *in = st->in;
+	int i;
 
-	ginit();
+	st->s = s;
+	/*\ Inputs that are cut off somewhere in this stripe \*/
+	for (i = 0; i < N; i++) {
+		st->dead[i] = (in[i].avail < in[i].size) &&
+			((s + st->chunk) > in[i].avail);
+		st->got[i] = 0;
+		st->len[i] = 0;
+		st->ip[i] = st->ibuf + (i * st->chunk);
+	}
+	st->pc = queue_reads(st, cache, q, base, N);
+}
 
-	/*\ Count number of recovery files \*/
-	for (i = Q = R = 0; in[i].filenr; i++) {
-		if (in[i].files) {
-			R++;
-			/*\ Get max. matrix row size \*/
-			for (k = 0; in[i].files[k]; k++) {
-				if (in[i].files[k] > Q)
-					Q = in[i].files[k];
+/*\ Wait for the reads of this stripe.
+|*|  Inputs that fail are marked dead, and another plan is tried.
+\*/
+static struct pcache *
+read_finish(struct stripe *st, struct pcache **cache, fqueue_t *q,
+		i64 *base, int N)
+{
+	xfile_t *in = st->in;
+	const u8 *p;
+	i64 tr;
+	int i, bad;
+
+	for (;;) {
+		bad = 0;
+		for (i = 0; i < N; i++) {
+			if ((st->got[i] != 1) && (st->got[i] != 3))
+				continue;
+			tr = st->chunk;
+			if (tr > (in[i].size - st->s))
+				tr = in[i].size - st->s;
+			if (st->got[i] == 3) {
+				p = file_map(in[i].f, base[i] + st->s, tr,
+						&st->res[i]);
+				if (p)
+					st->ip[i] = (u8 *)p;
+				else
+					st->res[i] = file_pread(in[i].f,
+						st->ibuf + (i * st->chunk), tr,
+						base[i] + st->s);
+			} else {
+				fq_wait(q, &st->res[i]);
 			}
-		} else {
-			if (in[i].filenr > Q)
-				Q = in[i].filenr;
+			st->got[i] = 2;
+			if (st->res[i] < tr) {
+				if (!st->rerr[i])
+					fprintf(stderr, "\n      READ ERROR: "
+						"%s at %lld\n",
+						in[i].f->name, st->s);
+				st->rerr[i] = 1;
+				st->dead[i] = 1;
+				bad = 1;
+				continue;
+			}
+			st->len[i] = st->res[i];
 		}
+		if (!bad)
+			return st->pc;
+		st->pc = queue_reads(st, cache, q, base, N);
+		fq_submit(q);
 	}
-	N = i;
+}
 
-	/*\ Count number of volumes to output \*/
-	for (i = j = M = 0; out[i].filenr; i++) {
-		M++;
-		if (out[i].files) {
-			j++;
-			/*\ Get max. matrix row size \*/
-			for (k = 0; out[i].files[k]; k++) {
-				if (out[i].files[k] > Q)
-					Q = out[i].files[k];
-			}
-		} else {
-			if (out[i].filenr > Q)
-				Q = out[i].filenr;
+/*\ Wait for the writes out of this stripe \*/
+static int
+write_finish(struct stripe *st, fqueue_t *q, int M)
+{
+	int j, ok = 1;
+
+	for (j = 0; j < M; j++) {
+		fq_wait(q, &st->wres[j]);
+		if (st->wres[j] < st->wlen[j]) {
+			fprintf(stderr, "\n      WRITE ERROR: %s\n",
+					st->out[j].f->name);
+			st->out[j].md5 = 0;
+			ok = 0;
 		}
+		st->wres[j] = st->wlen[j] = 0;
 	}
-	R += j;
-	Q += j;
+	return ok;
+}
 
-	CNEW(mt, R * Q);
-	CNEW(imt, R * N);
+/*\ Add this stripe of every output to its md5 sum, so the outputs
+|*|  don't have to be read back to check them.  Whole stripes of sums
+|*|  with nothing buffered go through the multi-buffer MD5 together.
+\*/
+static void
+stripe_md5(xfile_t *out, const u8 *work, i64 C, i64 s)
+{
+	struct md5_ctx *ctx[MD5MB_MAX];
+	const u8 *p[MD5MB_MAX];
+	int j, k = 0;
+	i64 tr;
 
-	/*\ Fill in matrix rows for recovery files \*/
-	for (i = j = 0; in[i].filenr; i++) {
-		if (!in[i].files)
+	for (j = 0; out[j].filenr; j++) {
+		if (!out[j].md5 || (s >= out[j].size))
 			continue;
-		for (k = 0; in[i].files[k]; k++)
-			MT(j, in[i].files[k]-1) = gpow(k+1, in[i].filenr - 1);
-		IMT(j, i) = 1;
-		j++;
-	}
-
-	/*\ Fill in matrix rows for output recovery files \*/
-	for (i = 0, l = Q; out[i].filenr; i++) {
-		if (!out[i].files)
+		tr = C;
+		if (tr > (out[j].size - s))
+			tr = out[j].size - s;
+		if ((tr < C) || out[j].md5->buflen) {
+			md5_process_bytes(work + (j * C), tr, out[j].md5);
 			continue;
-		for (k = 0; out[i].files[k]; k++)
-			MT(j, out[i].files[k]-1) = gpow(k+1, out[i].filenr - 1);
-		--l;
-		/*\ Fudge filenr \*/
-		out[i].filenr = l + 1;
-		MT(j, l) = 1;
-		j++;
+		}
+		ctx[k] = out[j].md5;
+		p[k++] = work + (j * C);
+		if (k == MD5MB_MAX) {
+			md5mb_blocks(ctx, p, k, C / 64);
+			k = 0;
+		}
 	}
+	if (k == 1)
+		md5_process_block(p[0], C, ctx[0]);
+	else if (k > 1)
+		md5mb_blocks(ctx, p, k, C / 64);
+}
 
-	if (cmd.loglevel > 0) {
-		fprintf(stderr, "Matrix input:\n");
-		for (i = 0; i < R; i++) {
-			fprintf(stderr, "| ");
-			for (j = 0; j < Q; j++)
-				fprintf(stderr, "%02x ", MT(i, j));
-			fprintf(stderr, "| ");
-			for (j = 0; j < N; j++)
-				fprintf(stderr, "%02x ", IMT(i, j));
-			fprintf(stderr, "|\n");
-		}
+/*\ Stripes that are being read, calculated or written at once \*/
+#define DEPTH 4
+/*\ Don't use more buffer memory than this for them \*/
+#define DEPTH_MEM 0x4000000
+
+/*\ With --io=hdd, read big chunks of every file in one go, in the
+|*|  order they are on the disk, so the heads don't go back and forth
+|*|  between the files all the time.
+\*/
+#define HDD_CHUNK 0x800000
+#define HDD_MEM 0x20000000
+
+struct place {
+	i64 key;
+	int i;
+};
+
+static int
+place_cmp(const void *a, const void *b)
+{
+	const struct place *x = a, *y = b;
+
+	if (x->key != y->key)
+		return (x->key < y->key) ? -1 : 1;
+	return x->i - y->i;
+}
+
+/*\ Order the inputs by where they are on the disk \*/
+static int *
+read_order(xfile_t *in, int N)
+{
+	struct place *pl;
+	int *order, i;
+
+	NEW(order, N);
+	for (i = 0; i < N; i++)
+		order[i] = i;
+	if (!cmd.hdd)
+		return order;
+	NEW(pl, N);
+	for (i = 0; i < N; i++) {
+		pl[i].key = file_place(in[i].f);
+		pl[i].i = i;
 	}
+	qsort(pl, N, sizeof(*pl), place_cmp);
+	for (i = 0; i < N; i++)
+		order[i] = pl[i].i;
+	free(pl);
+	return order;
+}
 
-	/*\ Use (virtual) rows from data files to eliminate columns \*/
-	for (i = 0; in[i].filenr; i++) {
-		if (in[i].files)
+static int
+do_recreate(xfile_t *in, xfile_t *out, int quiet)
+{
+	int i, j, d, D, M, N;
+	int *order;
+	u8 *dead, *lost, *rerr;
+	i64 *base, *obase;
+	struct pcache *cache = 0, *pc;
+	struct stripe *sl, *st;
+	u8 **planes;
+	i64 *psize;
+	fqueue_t *q;
+	int ret = 0;
+	i64 s, n, size, C;
+	i64 perc;
+
+	for (N = 0; in[N].filenr; N++)
+		;
+	for (M = 0; out[M].filenr; M++)
+		;
+	CNEW(dead, N);
+	CNEW(rerr, N);
+	CNEW(lost, M);
+	NEW(base, N);
+	NEW(obase, M);
+	for (i = 0; i < N; i++)
+		base[i] = file_tell(in[i].f);
+	for (j = 0; j < M; j++)
+		obase[j] = file_tell(out[j].f);
+
+	/*\ Outputs we can't make, even if every input is fine \*/
+	pc = find_plan(&cache, in, out, dead, N);
+	for (j = 0; j < M; j++) {
+		if (rs_plan_ok(pc->pl, j))
 			continue;
-		k = in[i].filenr - 1;
-		/*\ MT would have a 1 at (i, k), IMT a 1 at (i, i)
-		|*| IMT(j,i) -= MT(j,k) * IMT(i,i)  (is MT(j, k))
-		|*|  MT(j,k) -= MT(j,k) *  MT(i,k)  (becomes 0)
-		\*/
-		for (j = 0; j < R; j++) {
-			IMT(j, i) ^= MT(j, k);
-			MT(j, k) = 0;
-		}
+		out[j].size = 0;
+		out[j].md5 = 0;
 	}
 
-	if (cmd.loglevel > 0) {
-		fprintf(stderr, "Matrix after data file elimination:\n");
-		for (i = 0; i < R; i++) {
-			fprintf(stderr, "| ");
-			for (j = 0; j < Q; j++)
-				fprintf(stderr, "%02x ", MT(i, j));
-			fprintf(stderr, "| ");
-			for (j = 0; j < N; j++)
-				fprintf(stderr, "%02x ", IMT(i, j));
-			fprintf(stderr, "|\n");
-		}
-	}
+	/*\ Find out how much we should process in total \*/
+	size = 0;
+	for (i = 0; out[i].filenr; i++)
+		if (size < out[i].size)
+			size = out[i].size;
 
-	/*\ Eliminate columns using the remaining rows, so we get I.
-	|*| The accompanying matrix will be the inverse
+	/*\ While one stripe is calculated, the next ones are being read
+	|*|  and the previous ones written.
 	\*/
-	for (i = 0; i < R; i++) {
-		int d, l;
-		/*\ Find first non-zero entry \*/
-		for (l = 0; (l < Q) && !MT(i, l); l++)
-			;
-		if (l == Q) continue;
-		d = MT(i, l);
-		/*\ Scale the matrix so MT(i, l) becomes 1 \*/
-		for (j = 0; j < Q; j++)
-			MT(i, j) = gdiv(MT(i, j), d);
-		for (j = 0; j < N; j++)
-			IMT(i, j) = gdiv(IMT(i, j), d);
-		/*\ Eliminate the column in the other matrices \*/
-		for (k = 0; k < R; k++) {
-			if (k == i) continue;
-			d = MT(k, l);
-			for (j = 0; j < Q; j++)
-				MT(k, j) ^= gmul(MT(i, j), d);
-			for (j = 0; j < N; j++)
-				IMT(k, j) ^= gmul(IMT(i, j), d);
-		}
+	C = STRIPE;
+	D = DEPTH;
+	if (cmd.hdd) {
+		/*\ Double buffered, as big as memory allows \*/
+		D = 2;
+		C = (HDD_MEM / (D * (i64)(N + M))) & ~(i64)(STRIPE - 1);
+		if (C > HDD_CHUNK)
+			C = HDD_CHUNK;
+		if (C < STRIPE)
+			C = STRIPE;
+	} else {
+		while ((D > 1) && ((D * C * (i64)(N + M)) > DEPTH_MEM))
+			D--;
 	}
+	order = read_order(in, N);
+	q = fq_open(D * (N + M));
+	CNEW(sl, D);
+	d = pool_size();
+	if (d > (STRIPE / 0x400))
+		d = STRIPE / 0x400;
+	CNEW(planes, d);
+	CNEW(psize, d);
+	for (i = 0; i < D; i++) {
+		st = sl + i;
+		st->in = in;
+		st->out = out;
+		st->parts = d;
+		st->chunk = C;
+		st->order = order;
+		st->planes = planes;
+		st->psize = psize;
+		st->rerr = rerr;
+		st->ibuf = file_buf(C * N);
+		NEW(st->ip, N);
+		NEW(st->len, N);
+		st->work = file_buf(C * M);
+		NEW(st->dead, N);
+		NEW(st->got, N);
+		NEW(st->res, N);
+		CNEW(st->wres, M);
+		CNEW(st->wlen, M);
+	}
+	for (i = 0; (i < D) && ((i * C) < size); i++)
+		read_start(sl + i, &cache, q, base, N, i * C);
+	fq_submit(q);
 
-	if (cmd.loglevel > 0) {
-		fprintf(stderr, "Matrix after gaussian elimination:\n");
-		for (i = 0; i < R; i++) {
-			fprintf(stderr, "| ");
-			for (j = 0; j < Q; j++)
-				fprintf(stderr, "%02x ", MT(i, j));
-			fprintf(stderr, "| ");
-			for (j = 0; j < N; j++)
-				fprintf(stderr, "%02x ", IMT(i, j));
-			fprintf(stderr, "|\n");
-		}
+	perc = 0;
+	if (!quiet) {
+		fprintf(stderr, "0%%");
+		fflush(stderr);
 	}
+	/*\ Process all files \*/
+	for (s = 0, n = 0; s < size; s += C, n++) {
+		i64 tr;
 
-	/*\ Make the multiplication tables \*/
-	CNEW(muls, M * N);
+		/*\ Display progress \*/
+		while (!quiet && (((s * 50) / size) > perc)) {
+			perc++;
+			if (perc % 5) fprintf(stderr, ".");
+			else fprintf(stderr, "%lld%%", (perc / 5) * 10);
+			fflush(stderr);
+		}
 
-	for (i = 0; out[i].filenr; i++) {
-		/*\ File #x: The row IMT(j) for which MT(j,x) = 1 \*/
-		for (j = 0; j < R; j++) {
-			k = out[i].filenr - 1;
-			if (MT(j, k) != 1)
-				continue;
-			/*\ All other values should be 0 \*/
-			for (k = 0; !MT(j, k); k++)
-				;
-			if (k != out[i].filenr - 1)
+		/*\ Wait for this stripe of every input file we need \*/
+		st = sl + (n % D);
+		pc = read_finish(st, &cache, q, base, N);
+		for (j = 0; j < M; j++) {
+			if ((s >= out[j].size) || rs_plan_ok(pc->pl, j))
 				continue;
-			for (k++; (k < Q) && !MT(j, k); k++)
-				;
-			if (k != Q)
-				continue;
-			break;
-		}
-		/*\ Did we find a suitable row ? \*/
-		if (j == R) {
-			out[i].size = 0;
-			continue;
+			if (!lost[j])
+				fprintf(stderr, "\n      ERROR: %s: Can't be "
+					"restored from %lld on\n",
+					out[j].f->name, s);
+			lost[j] = 1;
+			/*\ What's left of it is no good, don't hash it \*/
+			out[j].md5 = 0;
 		}
-		for (k = 0; k < N; k++)
-			MULS(i, k) = IMT(j, k);
-	}
-	free(mt);
-	free(imt);
+		/*\ The work buffer is free once its last writes are done \*/
+		if (!write_finish(st, q, M))
+			goto fail;
 
-	if (cmd.loglevel > 0) {
-		fprintf(stderr, "Multipliers:\n");
-		for (i = 0; i < M; i++) {
-			fprintf(stderr, "| ");
-			for (j = 0; j < N; j++)
-				fprintf(stderr, "%02x ", MULS(i, j));
-			fprintf(stderr, "|\n");
+		/*\ Let the threads calculate the outputs \*/
+		st->pl = pc->pl;
+		st->map = pc->map;
+		pool_run(stripe_part, st, st->parts);
+		stripe_md5(out, st->work, C, s);
+
+		for (j = 0; out[j].filenr; j++) {
+			if (s >= out[j].size) continue;
+			tr = C;
+			if (tr > (out[j].size - s))
+				tr = out[j].size - s;
+			/*\ Leave a hole where there would be only zeroes \*/
+			if (cmd.sparse && is_zero(st->work + (j * C), tr))
+				continue;
+			st->wlen[j] = tr;
+			fq_write(q, out[j].f, st->work + (j * C), tr,
+					obase[j] + s, &st->wres[j]);
 		}
+		/*\ The input buffer is free now \*/
+		if ((s + D * C) < size)
+			read_start(st, &cache, q, base, N, s + D * C);
+		fq_submit(q);
 	}
+	ret = 1;
+	for (i = 0; i < D; i++)
+		if (!write_finish(sl + i, q, M))
+			ret = 0;
+	if (!ret)
+		goto fail;
+	if (!quiet) {
+		fprintf(stderr, "100%%\n");
+		fflush(stderr);
+	}
+	for (j = 0; j < M; j++)
+		if (lost[j])
+			ret = 0;
+fail:
+	/*\ Nothing may be still reading into or writing from the buffers \*/
+	fq_close(q);
+	for (i = 0; i < d; i++)
+		free(planes[i]);
+	free(planes);
+	free(psize);
+	for (i = 0; i < D; i++) {
+		st = sl + i;
+		free(st->ibuf);
+		free(st->ip);
+		free(st->len);
+		free(st->work);
+		free(st->dead);
+		free(st->got);
+		free(st->res);
+		free(st->wres);
+		free(st->wlen);
+	}
+	free(sl);
+	free(order);
+	free_pcache(cache);
+	free(dead);
+	free(rerr);
+	free(lost);
+	free(base);
+	free(obase);
+	return ret;
+}
 
-	/*\ Check for columns with all-zeroes \*/
-	for (j = 0; j < N; j++) {
-		for (i = 0; i < M; i++)
-			if (MULS(i, j))
-				break;
-		/*\ This input file isn't used \*/
-		if (i == M)
-			in[j].size = 0;
+int
+recreate(xfile_t *in, xfile_t *out)
+{
+	return do_recreate(in, out, 0);
+}
+
+int
+recreate_quiet(xfile_t *in, xfile_t *out)
+{
+	return do_recreate(in, out, 1);
+}
+
+/*\ Symbol x of a buffer, a byte or a little-endian word \*/
+static int
+symbol(const u8 *b, i64 x, int w)
+{
+	return w ? (b[x] | (b[x + 1] << 8)) : b[x];
+}
+
+/*\
+|*| Find and fix damage in data files, using the volumes.
+|*|  Every volume is made again from the data files, and XORed with
+|*|  the real one.  Where that syndrome isn't zero, a single bad symbol
+|*|  with error e in file k gives e times the coefficient of k in every
+|*|  volume.  Only the bad files are tried, and only an answer that
+|*|  fits every volume is used, so two volumes are needed to pick
+|*|  between more than one bad file.
+\*/
+i64
+repair(xfile_t *in, xfile_t *bad, xfile_t *vol)
+{
+	int i, j, k, b, w, M, N, B, K;
+	xfile_t *data;
+	rs_plan_t *pl;
+	struct iovec *iv, *ov;
+	u8 *ibuf, *obuf, *vbuf, *fixed, *chg;
+	u16 *coef;
+	i64 *lo, *hi, *base;
+	i64 s, x, y, top, size, tr, r, nfix = 0, nbad = 0;
+	i64 perc;
+
+	for (N = 0; in[N].filenr; N++)
+		;
+	for (B = 0; bad[B].filenr; B++)
+		;
+	for (M = 0; vol[M].filenr; M++)
+		;
+
+	/*\ The volumes, made from all the data files \*/
+	NEW(data, N + B + 1);
+	COPY(data, in, N);
+	COPY(data + N, bad, B + 1);
+	pl = rs_plan(data, vol);
+	plan_log(pl);
+	w = pl->wide;
+
+	/*\ Coefficient of every bad file in every volume we can check \*/
+	CNEW(coef, M * B);
+	for (j = K = 0; j < M; j++) {
+		if (!rs_plan_ok(pl, j))
+			continue;
+		for (b = 0; b < B; b++)
+			for (k = 0; vol[j].files[k]; k++)
+				if (vol[j].files[k] == bad[b].filenr)
+					coef[K * B + b] = fpow(w,
+						k+1, vol[j].filenr - 1);
+		K++;
 	}
 
-	/*\ Find out how much we should process in total \*/
-	size = 0;
-	for (i = 0; out[i].filenr; i++)
-		if (size < out[i].size)
-			size = out[i].size;
+	NEW(iv, N + B);
+	NEW(ov, M);
+	NEW(ibuf, STRIPE * (N + B));
+	CNEW(obuf, STRIPE * M);
+	NEW(vbuf, STRIPE);
+	NEW(fixed, B);
+	CNEW(chg, STRIPE * B);
+	NEW(lo, B);
+	NEW(hi, B);
+	NEW(base, M);
+	for (j = 0; j < M; j++)
+		base[j] = file_tell(vol[j].f);
 
-	/*\ Restore all the files at once \*/
-	NEW(work, sizeof(buf) * M);
+	size = 0;
+	for (j = 0; j < M; j++)
+		if (rs_plan_ok(pl, j) && (size < vol[j].size))
+			size = vol[j].size;
+	if (!K || !size) {
+		fprintf(stderr, "      ERROR: No volumes to check with\n");
+		nbad = 1;
+		size = 0;
+	}
 
 	perc = 0;
-	fprintf(stderr, "0%%"); fflush(stderr);
-	/*\ Process all files \*/
-	for (s = 0; s < size; ) {
-		i64 tr, r, q;
-		u8 *p;
-
+	if (size) {
+		fprintf(stderr, "0%%");
+		fflush(stderr);
+	}
+	for (s = 0; s < size; s += STRIPE) {
 		/*\ Display progress \*/
 		while (((s * 50) / size) > perc) {
 			perc++;
@@ -304,50 +2030,169 @@ recreate(xfile_t *in, xfile_t *out)
 			fflush(stderr);
 		}
 
-		/*\ See how much we should read \*/
-		memset(work, 0, sizeof(buf) * M);
-		for (i = 0; in[i].filenr; i++) {
-			tr = sizeof(buf);
-			if (tr > (in[i].size - s))
-				tr = in[i].size - s;
+		/*\ Read in this stripe of every data file \*/
+		for (i = 0; i < N + B; i++) {
+			iv[i].iov_base = ibuf + (i * STRIPE);
+			iv[i].iov_len = 0;
+			if (!rs_plan_used(pl, i))
+				continue;
+			tr = STRIPE;
+			if (tr > (data[i].size - s))
+				tr = data[i].size - s;
 			if (tr <= 0)
 				continue;
-			r = file_read(in[i].f, buf, tr);
+			r = file_pread(data[i].f, iv[i].iov_base, tr, s);
 			if (r < tr) {
-				perror("READ ERROR");
-				free(muls);
-				free(work);
-				return 0;
-			}
-			for (j = 0; out[j].filenr; j++) {
-				u8 lut[0x100];
-				if (s >= out[j].size) continue;
-				if (!MULS(j, i)) continue;
-				/*\ Precalc LUT \*/
-				make_lut(lut, MULS(j, i));
-				p = work + (j * sizeof(buf));
-				/*\ XOR it in, passed through the LUTs \*/
-				for (q = r; --q >= 0; )
-					p[q] ^= lut[buf[q]];
+				fprintf(stderr, "\n      READ ERROR: %s at %lld\n",
+						data[i].f->name, s);
+				goto fail;
 			}
+			iv[i].iov_len = r;
 		}
-		for (j = 0; out[j].filenr; j++) {
-			if (s >= out[j].size) continue;
-			tr = sizeof(buf);
-			if (tr > (out[j].size - s))
-				tr = out[j].size - s;
-			r = file_write(out[j].f, work + (j * sizeof(buf)), tr);
+
+		/*\ Make the volumes again, and compare \*/
+		for (j = k = 0; j < M; j++) {
+			ov[j].iov_base = 0;
+			ov[j].iov_len = 0;
+			if (!rs_plan_ok(pl, j))
+				continue;
+			tr = STRIPE;
+			if (tr > (vol[j].size - s))
+				tr = vol[j].size - s;
+			if (tr < 0)
+				tr = 0;
+			ov[j].iov_base = obuf + (k * STRIPE);
+			ov[j].iov_len = tr;
+			k++;
+		}
+		rs_apply_iov(pl, iv, ov);
+		for (j = k = 0; j < M; j++) {
+			if (!ov[j].iov_base)
+				continue;
+			tr = ov[j].iov_len;
+			memset(obuf + (k * STRIPE) + tr, 0, STRIPE - tr);
+			r = file_pread(vol[j].f, vbuf, tr, base[j] + s);
 			if (r < tr) {
-				perror("WRITE ERROR");
-				free(muls);
-				free(work);
-				return 0;
+				fprintf(stderr, "\n      READ ERROR: %s at %lld\n",
+						vol[j].f->name, s);
+				goto fail;
+			}
+			gk.xor(obuf + (k * STRIPE), vbuf, tr);
+			k++;
+		}
+		for (k = 0; k < K; k++)
+			if (!is_zero(obuf + (k * STRIPE), STRIPE))
+				break;
+		if (k == K)
+			continue;
+
+		/*\ Find out which file is wrong, symbol by symbol \*/
+		for (b = 0; b < B; b++) {
+			fixed[b] = 0;
+			lo[b] = STRIPE;
+			hi[b] = 0;
+		}
+		for (x = 0; x < STRIPE; x += 1 + w) {
+			int d, e, fb, fe;
+
+			for (k = 0; (k < K) && !symbol(obuf + k * STRIPE, x, w);
+					k++)
+				;
+			if (k == K)
+				continue;
+			d = k;
+			fb = -1;
+			fe = 0;
+			for (b = 0; b < B; b++) {
+				if (!coef[d * B + b] || (s + x >= bad[b].size))
+					continue;
+				e = fdiv(w, symbol(obuf + d * STRIPE, x, w),
+						coef[d * B + b]);
+				for (k = 0; k < K; k++)
+					if (fmul(w, coef[k * B + b], e) !=
+						symbol(obuf + k * STRIPE, x, w))
+						break;
+				if (k < K)
+					continue;
+				if (fb >= 0) {
+					fb = -2;
+					break;
+				}
+				fb = b;
+				fe = e;
+			}
+			if (fb < 0) {
+				if (!nbad)
+					fprintf(stderr, "\n      ERROR: Can't "
+						"tell which file is bad at "
+						"%lld\n", s + x);
+				nbad++;
+				continue;
+			}
+			i = N + fb;
+			ibuf[i * STRIPE + x] ^= fe & 0xff;
+			if (fe & 0xff)
+				chg[fb * STRIPE + x] = 1;
+			if (w) {
+				ibuf[i * STRIPE + x + 1] ^= fe >> 8;
+				if (fe >> 8)
+					chg[fb * STRIPE + x + 1] = 1;
+			}
+			fixed[fb] = 1;
+			if (x < lo[fb]) lo[fb] = x;
+			if (x + w > hi[fb]) hi[fb] = x + w;
+		}
+
+		/*\ Write back only the bytes that changed, run by run \*/
+		for (b = 0; b < B; b++) {
+			if (!fixed[b])
+				continue;
+			top = hi[b];
+			/*\ Don't write the other half of a last odd byte \*/
+			if (s + hi[b] >= bad[b].size)
+				hi[b] = bad[b].size - s - 1;
+			for (x = lo[b]; x <= hi[b]; x = y) {
+				if (!chg[b * STRIPE + x]) {
+					y = x + 1;
+					continue;
+				}
+				for (y = x; (y <= hi[b]) &&
+						chg[b * STRIPE + y]; y++)
+					;
+				tr = y - x;
+				r = file_pwrite(bad[b].f, ibuf +
+						((N + b) * STRIPE) + x,
+						tr, s + x);
+				if (r < tr) {
+					perror("WRITE ERROR");
+					goto fail;
+				}
+				nfix += tr;
 			}
+			memset(chg + (b * STRIPE) + lo[b], 0, top + 1 - lo[b]);
 		}
-		s += sizeof(buf);
 	}
-	fprintf(stderr, "100%%\n"); fflush(stderr);
-	free(muls);
-	free(work);
-	return 1;
+	if (size) {
+		fprintf(stderr, "100%%\n");
+		fflush(stderr);
+	}
+	if (!nbad)
+		goto end;
+fail:
+	nfix = -1;
+end:
+	rs_plan_free(pl);
+	free(data);
+	free(coef);
+	free(iv);
+	free(ov);
+	free(ibuf);
+	free(obuf);
+	free(vbuf);
+	free(fixed);
+	free(chg);
+	free(lo);
+	free(hi);
+	free(base);
+	return nfix;
 }
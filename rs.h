@@ -12,15 +12,70 @@
 #ifndef REEDSOLOMON_H
 #define REEDSOLOMON_H
 
+#include <sys/uio.h>
+
 typedef struct xfile_s xfile_t;
+typedef struct rs_plan_s rs_plan_t;
 
+/*\ A data file or volume.
+|*|  size: Size of the data (the rest counts as zeroes)
+|*|  avail: Bytes that can be read, if the file is cut short
+|*|  filenr: file number or volume number (0 ends a list)
+|*|  files: 0 for a data file, file numbers in the volume for a volume
+|*|  md5: for an output, if set, what's written is added to it in order.
+|*|   It's cleared if the output can't be made or written in full.
+\*/
 struct xfile_s {
 	i64 size;
+	i64 avail;
 	file_t f;
 	u16 filenr;
 	u16 *files;
+	struct md5_ctx *md5;
 };
 
+/*\ Volumes with more than 255 files, or numbers above 255, are coded
+|*|  over GF(16), in 16-bit little-endian words, and have version 2.
+\*/
+#define RS_WIDE(nfiles, vol) (((nfiles) > 255) || ((vol) > 255))
+
+/*\ Read the inputs and write the outputs, all at once \*/
 int recreate(xfile_t *in, xfile_t *out);
 
+/*\ Same, without showing progress, for running several at once \*/
+int recreate_quiet(xfile_t *in, xfile_t *out);
+
+/*\ Fix the bytes in the bad data files that don't agree with the
+|*|  other data files and the volumes, in place.
+|*|  Returns the number of bytes rewritten, -1 if not all could be fixed.
+\*/
+i64 repair(xfile_t *in, xfile_t *bad, xfile_t *vol);
+
+/*\
+|*| In-memory coding, in two steps.
+|*|  rs_plan() works out how to make the outputs out of the inputs,
+|*|  only looking at filenr and files.  The plan can then be applied
+|*|  to any number of buffers, for any byte range, from any number of
+|*|  threads at the same time.  It does no I/O and copies no data.
+\*/
+rs_plan_t *rs_plan(xfile_t *in, xfile_t *out);
+void rs_plan_free(rs_plan_t *plan);
+
+/*\ Can output j be made ?  Is input i needed ? \*/
+int rs_plan_ok(rs_plan_t *plan, int j);
+int rs_plan_used(rs_plan_t *plan, int i);
+
+/*\ Calculate len bytes of every output from len bytes of every input.
+|*|  in[i] or out[j] may be 0 to skip an input or output.
+|*|  A wide plan (GF(16)) works on 16-bit words, so the bytes must start
+|*|  at an even offset in the files; only the end of a file may be odd.
+\*/
+void rs_apply(rs_plan_t *plan, u8 **in, u8 **out, i64 len);
+
+/*\ Same, with a buffer and length for every input and output.
+|*|  Inputs shorter than an output count as zero padded.
+\*/
+void rs_apply_iov(rs_plan_t *plan, const struct iovec *in,
+		const struct iovec *out);
+
 #endif
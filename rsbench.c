@@ -0,0 +1,147 @@
+/*\
+|*|  Parity Archive - A way to restore missing files in a set.
+|*|
+|*|  Copyright (C) 2001  Willem Monsuwe (willem@stack.nl)
+|*|
+|*|  Benchmark the Reed-Solomon engines against each other.
+|*|   Usage: rsbench [files [volumes [size in KB]]]
+\*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "types.h"
+#include "fileops.h"
+#include "rs.h"
+#include "util.h"
+#include "par.h"
+
+struct cmdline cmd;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*\ Make M volumes out of N files, return the time it took \*/
+static double
+run(int N, int M, i64 size, u16 *fnrs, const char *tag)
+{
+	xfile_t *in, *out;
+	char name[64];
+	double t;
+	int i;
+
+	NEW(in, N + 1);
+	NEW(out, M + 1);
+	for (i = 0; i < N; i++) {
+		sprintf(name, "rsbench.%d", i + 1);
+		in[i].f = file_open_ascii(name, 0);
+		in[i].filenr = i + 1;
+		in[i].files = 0;
+		in[i].size = size;
+		in[i].avail = size;
+	}
+	in[i].filenr = 0;
+	for (i = 0; i < M; i++) {
+		sprintf(name, "rsbench.%s%02d", tag, i + 1);
+		remove(name);
+		out[i].f = file_open_ascii(name, 1);
+		out[i].filenr = i + 1;
+		out[i].files = fnrs;
+		out[i].size = size;
+		out[i].md5 = 0;
+	}
+	out[i].filenr = 0;
+	t = now();
+	if (!recreate(in, out))
+		fprintf(stderr, "recreate() failed\n");
+	for (i = 0; i < M; i++)
+		file_close(out[i].f);
+	t = now() - t;
+	for (i = 0; i < N; i++)
+		file_close(in[i].f);
+	free(in);
+	free(out);
+	return t;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int N = 50, M = 5, i, j, diff;
+	i64 size = 4096;
+	u16 *fnrs;
+	u8 *buf, *b2;
+	char name[64];
+	FILE *f, *g;
+	double tm, tx;
+
+	if (argc > 1) N = atoi(argv[1]);
+	if (argc > 2) M = atoi(argv[2]);
+	if (argc > 3) size = atoi(argv[3]);
+	size <<= 10;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.threads = 1;
+
+	/*\ Make the input files \*/
+	NEW(buf, size);
+	NEW(b2, size);
+	srand(1);
+	for (i = 0; i < N; i++) {
+		for (j = 0; j < size; j++)
+			buf[j] = rand() >> 7;
+		sprintf(name, "rsbench.%d", i + 1);
+		f = fopen(name, "wb");
+		fwrite(buf, 1, size, f);
+		fclose(f);
+	}
+	NEW(fnrs, N + 1);
+	for (i = 0; i < N; i++)
+		fnrs[i] = i + 1;
+	fnrs[i] = 0;
+
+	cmd.bitmat = 0;
+	tm = run(N, M, size, fnrs, "m");
+	cmd.bitmat = 1;
+	tx = run(N, M, size, fnrs, "x");
+
+	/*\ Both engines should give the same volumes \*/
+	diff = 0;
+	for (i = 0; i < M; i++) {
+		sprintf(name, "rsbench.m%02d", i + 1);
+		f = fopen(name, "rb");
+		sprintf(name, "rsbench.x%02d", i + 1);
+		g = fopen(name, "rb");
+		if (((i64)fread(buf, 1, size, f) != size) ||
+				((i64)fread(b2, 1, size, g) != size) ||
+				memcmp(buf, b2, size))
+			diff++;
+		fclose(f);
+		fclose(g);
+		remove(name);
+		sprintf(name, "rsbench.m%02d", i + 1);
+		remove(name);
+	}
+	for (i = 0; i < N; i++) {
+		sprintf(name, "rsbench.%d", i + 1);
+		remove(name);
+	}
+
+	printf("%d files, %d volumes, %lld KB each\n", N, M, size >> 10);
+	printf("  GF multiply engine: %8.1f MB/s\n", (N * size) / tm / 1e6);
+	printf("  XOR-only engine:    %8.1f MB/s\n", (N * size) / tx / 1e6);
+	if (diff)
+		printf("  %d volumes DIFFER\n", diff);
+	free(buf);
+	free(b2);
+	free(fnrs);
+	return diff != 0;
+}
@@ -18,6 +18,7 @@
 #include "rwpar.h"
 #include "fileops.h"
 #include "rs.h"
+#include "pool.h"
 #include "readoldpar.h"
 #include "md5.h"
 #include "backend.h"
@@ -445,6 +446,27 @@ write_file_entries(file_t f, pfile_t *files)
 	return tot;
 }
 
+/*\ Get the outputs on the disk, if asked to.
+|*|  If bad is given, bad[i] is set for every output that failed.
+\*/
+static int
+sync_out(xfile_t *out, u8 *bad)
+{
+	file_t *fs;
+	int i, e;
+
+	for (i = 0; out[i].filenr; i++)
+		;
+	NEW(fs, i + 1);
+	for (i = 0; out[i].filenr; i++)
+		fs[i] = out[i].f;
+	e = file_sync(fs, i, bad);
+	free(fs);
+	if (e < 0)
+		perror("      ERROR: sync");
+	return e;
+}
+
 /*\
 |*| Write out a PAR volume header
 \*/
@@ -474,6 +496,12 @@ write_par_header(par_t *par)
 	par->file_list = PAR_FIX_HEAD_SIZE;
 	par->file_list_size = write_file_entries(0, par->files);
 	par->data = par->file_list + par->file_list_size;
+	/*\ The header says where the data is, so it can be moved up to
+	|*|  a nice boundary, for O_DIRECT and mmap.
+	\*/
+	if (par->vol_number && (cmd.align > 1))
+		par->data = ((par->data + cmd.align - 1) / cmd.align) *
+				cmd.align;
 
 	if (par->vol_number == 0) {
 		par->data_size = uni_sizeof(par->comment);
@@ -490,6 +518,12 @@ write_par_header(par_t *par)
 		if (USE_FILE(p))
 			i++;
 	}
+	/*\ Big sets are coded in 16-bit words \*/
+	if (RS_WIDE(i, par->vol_number)) {
+		par->version = 0x00020000;
+		if (par->vol_number)
+			par->data_size += par->data_size & 1;
+	}
 	NEW(hashes, i);
 	for (i = 0, p = par->files; p; p = p->next) {
 		if (!USE_FILE(p))
@@ -507,6 +541,14 @@ write_par_header(par_t *par)
 
 	file_write(f, &data, PAR_FIX_HEAD_SIZE);
 	write_file_entries(f, par->files);
+	if (par->data > par->file_list + par->file_list_size) {
+		u8 *pad;
+		i64 n = par->data - (par->file_list + par->file_list_size);
+
+		CNEW(pad, n);
+		file_write(f, pad, n);
+		free(pad);
+	}
 
 	if (par->vol_number == 0) {
 		file_write(f, par->comment, par->data_size);
@@ -524,19 +566,67 @@ write_par_header(par_t *par)
 				if (!cmd.keep) file_delete(par->filename);
 			}
 		}
-		if (f) file_close(f);
+		if (f) {
+			xfile_t out[2];
+			u8 bad = 0;
+
+			memset(out, 0, sizeof(out));
+			out[0].filenr = 1;	/*\ Anything but 0 \*/
+			out[0].f = f;
+			sync_out(out, &bad);
+			file_close(f);
+			if (bad) {
+				fprintf(stderr, "  %-40s - FAILED\n",
+						basename(par->filename));
+				f = 0;
+				if (!cmd.keep) file_delete(par->filename);
+			}
+		}
 	}
 	return f;
 }
 
 /*\
-|*| Restore missing files with recovery volumes
+|*| Restoring is done in three steps: opening all files, recreating
+|*|  the missing ones, and checking the results.  Only the middle one
+|*|  can be run for several sets at once.
 \*/
-int
-restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
+struct restore {
+	pfile_t *files, *volumes;	/*\ Existing files and volumes \*/
+	pfile_t *mis_f, *mis_v;		/*\ Missing files and volumes \*/
+	xfile_t *in, *out;
+	struct md5_ctx *md5;	/*\ md5 sums of the outputs, as written \*/
+	int np, n;	/*\ Partial files are in[np] to in[n-1] \*/
+	int fail;
+	sub_t *sub;
+};
+
+/*\ Hash the header of a new volume, from the control hash up to
+|*|  the data.  Returns 0 on failure.
+\*/
+static int
+md5_header(file_t f, i64 data, struct md5_ctx *ctx)
 {
-	int N, M, i;
+	u8 *buf;
+	i64 n = data - 0x0020;
+
+	NEW(buf, n);
+	if (file_pread(f, buf, n, 0x0020) != n) {
+		free(buf);
+		return 0;
+	}
+	md5_process_bytes(buf, n, ctx);
+	free(buf);
+	return 1;
+}
+
+static void
+restore_open(struct restore *r, pfile_t *files, pfile_t *volumes, sub_t *sub)
+{
+	int N, M, i, n, np;
+	hfile_t *part;
 	xfile_t *in, *out;
+	struct md5_ctx *md5;
 	pfile_t *p, *v, **pp, **qq;
 	int fail = 0;
 	i64 size;
@@ -600,8 +690,9 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 	for (v = mis_v; v; v = v->next, N++)
 		M++;
 
-	NEW(in, N + 1);
+	NEW(in, N + M + 1);
 	NEW(out, M + 1);
+	NEW(md5, M + 1);
 
 	/*\ Fill in input files \*/
 	for (i = 0, p = files; p; p = p->next) {
@@ -615,6 +706,7 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 		in[i].filenr = p->vol_number;
 		in[i].files = 0;
 		in[i].size = p->file_size;
+		in[i].avail = p->file_size;
 		in[i].f = p->f;
 		i++;
 	}
@@ -623,14 +715,17 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 		in[i].filenr = v->vol_number;
 		in[i].files = v->fnrs;
 		in[i].size = v->file_size;
+		in[i].avail = v->file_size;
 		in[i].f = v->f;
 		i++;
 	}
 	in[i].filenr = 0;
+	np = n = i;
 
 	/*\ Fill in output files \*/
 	for (i = 0, p = mis_f; p; p = p->next) {
 		path = do_sub(p->filename, sub);
+		part = find_partial(path, p);
 		/*\ Open output file, but check we don't overwrite anything \*/
 		if (move_away(path, ".bad")) {
 			fprintf(stderr, "      ERROR: %s: ",
@@ -649,11 +744,37 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 				basename(path));
 			continue;
 		}
+		/*\ Find out now if it fits, not halfway through \*/
+		if (file_alloc(p->f, p->file_size) < 0) {
+			fprintf(stderr, "      ERROR: %s: ",
+				basename(path));
+			perror("");
+			fprintf(stderr, "  %-40s - NOT RESTORED\n",
+				basename(path));
+			file_close(p->f);
+			p->f = 0;
+			file_delete(path);
+			continue;
+		}
 		out[i].size = p->file_size;
 		out[i].filenr = p->vol_number;
 		out[i].files = 0;
 		out[i].f = p->f;
+		out[i].md5 = md5 + i;
+		md5_init_ctx(md5 + i);
 		i++;
+		/*\ The start of a file that was cut short is still good \*/
+		if (part && (in[n].f = file_open(part->filename, 0))) {
+			fprintf(stderr, "    Partial: %s", basename(path));
+			fprintf(stderr, " (%lld of %lld bytes)\n",
+					part->file_size, p->file_size);
+			in[n].filenr = p->vol_number;
+			in[n].files = 0;
+			in[n].size = p->file_size;
+			in[n].avail = part->file_size;
+			n++;
+			in[n].filenr = 0;
+		}
 	}
 
 	/*\ Fill in output volumes \*/
@@ -678,6 +799,36 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 			free_par(par);
 			continue;
 		}
+		if (file_alloc(v->f, par->data + par->data_size) < 0) {
+			fprintf(stderr, "      ERROR: %s: ",
+					basename(par->filename));
+			perror("");
+			fprintf(stderr, "  %-40s - FAILED\n",
+					basename(par->filename));
+			file_close(v->f);
+			v->f = 0;
+			file_delete(par->filename);
+			fail |= 1;
+			free_par(par);
+			continue;
+		}
+		/*\ The control hash covers the header after itself,
+		|*|  the rest comes in while the volume is written.
+		\*/
+		md5_init_ctx(md5 + i);
+		if (!md5_header(v->f, par->data, md5 + i)) {
+			fprintf(stderr, "      ERROR: %s: ",
+					basename(par->filename));
+			perror("");
+			fprintf(stderr, "  %-40s - FAILED\n",
+					basename(par->filename));
+			file_close(v->f);
+			v->f = 0;
+			file_delete(par->filename);
+			fail |= 1;
+			free_par(par);
+			continue;
+		}
 		v->match = hfile_add(par->filename);
 		v->filename = v->match->filename;
 		v->file_size = par->data + par->data_size;
@@ -685,25 +836,96 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 		out[i].filenr = v->vol_number;
 		out[i].files = v->fnrs;
 		out[i].f = v->f;
+		out[i].md5 = md5 + i;
 		free_par(par);
 		i++;
 	}
 	out[i].filenr = 0;
 
-	if (!recreate(in, out))
-		fail |= 1;
+	r->files = files;
+	r->volumes = volumes;
+	r->mis_f = mis_f;
+	r->mis_v = mis_v;
+	r->in = in;
+	r->out = out;
+	r->md5 = md5;
+	r->np = np;
+	r->n = n;
+	r->fail = fail;
+	r->sub = sub;
+}
 
-	free(in);
-	free(out);
+/*\ Number of bytes that went into an md5 sum \*/
+static i64
+md5_len(struct md5_ctx *ctx)
+{
+	return ctx->total[0] + ((i64)ctx->total[1] << 32) + ctx->buflen;
+}
+
+static int
+restore_check(struct restore *r)
+{
+	int i, j, nf, fail = r->fail;
+	pfile_t *p, *v;
+	pfile_t *files = r->files, *volumes = r->volumes;
+	pfile_t *mis_f = r->mis_f, *mis_v = r->mis_v;
+	sub_t *sub = r->sub;
+	struct md5_ctx *ctx;
+	md5 hash;
+	u16 *path;
+	u8 *bad;
+
+	for (i = r->np; i < r->n; i++)
+		file_close(r->in[i].f);
+	for (i = 0; r->out[i].filenr; i++)
+		;
+	CNEW(bad, i + 1);
+	/*\ Outputs recreate() couldn't make in full \*/
+	for (i = 0; r->out[i].filenr; i++)
+		bad[i] = !r->out[i].md5;
+
+	/*\ Put the control hash in the resulting volumes,
+	|*|  before everything is synced
+	\*/
+	for (nf = 0, p = mis_f; p; p = p->next)
+		if (p->f)
+			nf++;
+	for (j = nf, v = mis_v; v; v = v->next) {
+		if (!v->f) continue;
+		ctx = r->out[j].md5;
+		if (!ctx || (md5_len(ctx) != v->file_size - 0x0020)) {
+			bad[j++] = 1;
+			continue;
+		}
+		md5_finish_ctx(ctx, hash);
+		if (file_pwrite(v->f, hash, sizeof(hash), 0x0010)
+				!= sizeof(hash))
+			bad[j] = 1;
+		j++;
+	}
+	if (sync_out(r->out, bad))
+		fail |= 1;
 
-	/*\ Check resulting data files \*/
-	for (p = mis_f; p; p = p->next) {
+	/*\ Check resulting data files.
+	|*|  The md5 sums were taken as the files were written, only the
+	|*|  first 16k is read back for the 16k hash.
+	\*/
+	for (j = 0, p = mis_f; p; p = p->next) {
 		if (!p->f) continue;
+		i = j++;
+		ctx = r->out[i].md5;
 		file_close(p->f);
 		p->f = 0;
 		path = do_sub(p->filename, sub);
 		p->match = hfile_add(path);
-		if (!hash_file(p->match, HASH)) {
+		if (bad[i]) {
+			fprintf(stderr, "  %-40s - NOT RESTORED\n",
+					basename(path));
+			fail |= 1;
+			if (!cmd.keep) file_delete(path);
+			continue;
+		}
+		if (!hash_file(p->match, HASH16K)) {
 			fprintf(stderr, "      ERROR: %s:",
 					basename(path));
 			perror("");
@@ -713,13 +935,16 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 			if (!cmd.keep) file_delete(path);
 			continue;
 		}
-		if ((p->match->file_size == 0) && (p->file_size != 0)) {
+		if (md5_len(ctx) != p->file_size) {
 			fprintf(stderr, "  %-40s - NOT RESTORED\n",
 					basename(path));
 			fail |= 1;
 			if (!cmd.keep) file_delete(path);
 			continue;
 		}
+		md5_finish_ctx(ctx, p->match->hash);
+		p->match->file_size = p->file_size;
+		p->match->hashed = HASH;
 		if (!CMP_MD5(p->match->hash, p->hash)) {
 			fprintf(stderr, "      ERROR: %s: Failed md5 check\n",
 					basename(path));
@@ -736,7 +961,7 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 	/*\ Check resulting volumes \*/
 	for (v = mis_v; v; v = v->next) {
 		if (!v->f) continue;
-		if (!file_add_md5(v->f, 0x0010, 0x0020, v->file_size)) {
+		if (bad[j++]) {
 			fprintf(stderr, "  %-40s - FAILED\n",
 					basename(v->filename));
 			fail |= 1;
@@ -747,6 +972,10 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 		}
 		fprintf(stderr, "  %-40s - OK\n", basename(v->filename));
 	}
+	free(r->in);
+	free(r->out);
+	free(r->md5);
+	free(bad);
 
 	while ((p = files)) {
 		files = p->next;
@@ -771,3 +1000,271 @@ restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
 	}
 	return 1;
 }
+
+/*\
+|*| Restore missing files with recovery volumes
+\*/
+int
+restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
+{
+	struct restore r;
+
+	restore_open(&r, files, volumes, sub);
+	if (!recreate(r.in, r.out))
+		r.fail |= 1;
+	return restore_check(&r);
+}
+
+/*\ Union-find on file numbers \*/
+static int
+set_find(int *set, int i)
+{
+	while (set[i] != i)
+		i = set[i] = set[set[i]];
+	return i;
+}
+
+static void
+restore_one(void *arg, int i)
+{
+	struct restore *r = arg;
+
+	if (!recreate_quiet(r[i].in, r[i].out))
+		r[i].fail |= 1;
+}
+
+/*\
+|*| Restore missing files, with every group of files and volumes
+|*|  that doesn't share anything with the others as a separate set.
+|*|  The sets are smaller, only read their own files, and are done
+|*|  at the same time.
+\*/
+int
+restore_sets(pfile_t *files, pfile_t *volumes, sub_t *sub)
+{
+	int i, j, k, n, ns, *set, *num, *pos;
+	pfile_t *p, *v, **fl, **vl, **pp;
+	struct restore *r;
+	int fail = 0;
+
+	for (n = 0, p = files; p; p = p->next)
+		n++;
+	NEW(set, n + 1);
+	NEW(num, n + 1);
+	NEW(pos, n + 1);
+	for (i = 0; i <= n; i++) {
+		set[i] = i;
+		num[i] = -1;
+	}
+
+	/*\ Files in the same volume are in the same set \*/
+	for (v = volumes; v; v = v->next)
+		for (k = 1; v->fnrs[0] && v->fnrs[k]; k++)
+			set[set_find(set, v->fnrs[k])] =
+				set_find(set, v->fnrs[0]);
+
+	/*\ Only sets with something missing are numbered \*/
+	ns = 0;
+	for (i = 1, p = files; p; p = p->next, i++) {
+		if (!USE_FILE(p) || find_file(p, 0))
+			continue;
+		if (num[set_find(set, i)] < 0)
+			num[set_find(set, i)] = ns++;
+	}
+	for (v = volumes; v; v = v->next) {
+		if (!v->vol_number || v->f || !v->fnrs[0])
+			continue;
+		if (num[set_find(set, v->fnrs[0])] < 0)
+			num[set_find(set, v->fnrs[0])] = ns++;
+	}
+	if (ns <= 1) {
+		free(set);
+		free(num);
+		free(pos);
+		return restore_files(files, volumes, sub);
+	}
+	if (cmd.loglevel > 0)
+		fprintf(stderr, "    %d separate sets\n", ns);
+
+	/*\ Make a file and a volume list for every set.
+	|*|  The file numbers in the volumes count within the set.
+	\*/
+	CNEW(fl, ns);
+	CNEW(vl, ns);
+	for (i = 1, p = files; p; p = p->next, i++) {
+		j = num[set_find(set, i)];
+		if (j < 0)
+			continue;
+		for (k = 1, pp = fl + j; *pp; pp = &((*pp)->next))
+			k++;
+		NEW(*pp, 1);
+		COPY(*pp, p, 1);
+		(*pp)->next = 0;
+		pos[i] = k;
+	}
+	for (v = volumes; v; v = v->next) {
+		if (!v->fnrs[0])
+			continue;
+		j = num[set_find(set, v->fnrs[0])];
+		if (j < 0)
+			continue;
+		for (pp = vl + j; *pp; pp = &((*pp)->next))
+			;
+		NEW(*pp, 1);
+		COPY(*pp, v, 1);
+		(*pp)->next = 0;
+		for (k = 0; v->fnrs[k]; k++)
+			;
+		NEW((*pp)->fnrs, k + 1);
+		for (k = 0; v->fnrs[k]; k++)
+			(*pp)->fnrs[k] = pos[v->fnrs[k]];
+		(*pp)->fnrs[k] = 0;
+	}
+
+	/*\ Open everything, recreate all sets at once, and check \*/
+	NEW(r, ns);
+	for (j = 0; j < ns; j++)
+		restore_open(r + j, fl[j], vl[j], sub);
+	fprintf(stderr, "Recreating %d sets...", ns);
+	fflush(stderr);
+	pool_spawn(restore_one, r, ns);
+	fprintf(stderr, " done\n");
+	for (j = 0; j < ns; j++)
+		if (restore_check(r + j) < 0)
+			fail = 1;
+
+	for (j = 0; j < ns; j++) {
+		while ((p = fl[j])) {
+			fl[j] = p->next;
+			free(p);
+		}
+		while ((v = vl[j])) {
+			vl[j] = v->next;
+			free(v->fnrs);
+			free(v);
+		}
+	}
+	free(fl);
+	free(vl);
+	free(r);
+	free(set);
+	free(num);
+	free(pos);
+	return fail ? -1 : 1;
+}
+
+/*\
+|*| Repair damaged files in place, with the recovery volumes
+|*|  Returns the number of files that are still damaged.
+\*/
+int
+repair_files(pfile_t *files, pfile_t *volumes, sub_t *sub)
+{
+	int N, B, M, i, left = 0;
+	xfile_t *in, *bad, *vol;
+	pfile_t *p, *v;
+	hfile_t **dmg;
+	i64 r;
+
+	for (N = 0, p = files; p; p = p->next)
+		N++;
+	for (M = 0, v = volumes; v; v = v->next)
+		M++;
+	NEW(in, N + 1);
+	NEW(bad, N + 1);
+	NEW(dmg, N + 1);
+	NEW(vol, M + 1);
+
+	/*\ Sort out good and damaged data files \*/
+	N = B = 0;
+	for (i = 1, p = files; p; p = p->next, i++) {
+		p->vol_number = i;
+		if (!USE_FILE(p))
+			continue;
+		if (find_file(p, 0)) {
+			in[N].filenr = i;
+			in[N].files = 0;
+			in[N].size = p->file_size;
+			in[N].avail = p->file_size;
+			in[N].f = file_open(p->match->filename, 0);
+			N++;
+			continue;
+		}
+		dmg[B] = find_damaged(do_sub(p->filename, sub), p);
+		if (!dmg[B]) {
+			fprintf(stderr, "  %-40s - NOT FOUND\n",
+					basename(p->filename));
+			left++;
+			continue;
+		}
+		bad[B].f = file_open(dmg[B]->filename, 2);
+		if (!bad[B].f) {
+			fprintf(stderr, "      ERROR: %s:",
+					basename(dmg[B]->filename));
+			perror("");
+			fprintf(stderr, "  %-40s - NOT REPAIRED\n",
+					basename(dmg[B]->filename));
+			left++;
+			continue;
+		}
+		bad[B].filenr = i;
+		bad[B].files = 0;
+		bad[B].size = p->file_size;
+		bad[B].avail = p->file_size;
+		B++;
+	}
+	in[N].filenr = 0;
+	bad[B].filenr = 0;
+
+	for (M = 0, v = volumes; v; v = v->next) {
+		vol[M].filenr = v->vol_number;
+		vol[M].files = v->fnrs;
+		vol[M].size = v->file_size;
+		vol[M].avail = v->file_size;
+		vol[M].f = v->f;
+		M++;
+	}
+	vol[M].filenr = 0;
+
+	/*\ Missing files would have to be restored as well \*/
+	if (left) {
+		fprintf(stderr, "      ERROR: Can't repair with "
+				"files missing\n");
+		for (i = 0; i < B; i++)
+			file_close(bad[i].f);
+		left += B;
+		B = 0;
+	}
+	if (B) {
+		r = repair(in, bad, vol);
+		if (r >= 0)
+			fprintf(stderr, "    Repaired %lld bytes\n", r);
+		sync_out(bad, 0);
+	}
+
+	/*\ Check the repaired files \*/
+	for (i = 0; i < B; i++) {
+		file_close(bad[i].f);
+		dmg[i]->hashed = 0;
+		if (hash_file(dmg[i], HASH)) {
+			for (p = files; p; p = p->next)
+				if (p->vol_number == bad[i].filenr)
+					break;
+			if (CMP_MD5(dmg[i]->hash, p->hash)) {
+				fprintf(stderr, "  %-40s - REPAIRED\n",
+					basename(dmg[i]->filename));
+				continue;
+			}
+		}
+		fprintf(stderr, "  %-40s - NOT REPAIRED\n",
+				basename(dmg[i]->filename));
+		left++;
+	}
+	for (i = 0; i < N; i++)
+		file_close(in[i].f);
+	free(in);
+	free(bad);
+	free(dmg);
+	free(vol);
+	return left;
+}
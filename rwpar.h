@@ -20,6 +20,8 @@ void free_file_list(pfile_t *list);
 void free_par(par_t *par);
 file_t write_par_header(par_t *par);
 int restore_files(pfile_t *files, pfile_t *volumes, sub_t *sub);
+int restore_sets(pfile_t *files, pfile_t *volumes, sub_t *sub);
+int repair_files(pfile_t *files, pfile_t *volumes, sub_t *sub);
 
 void dump_par(par_t *par);
 
@@ -14,6 +14,7 @@ typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef signed long long i64;
+typedef unsigned long long u64;
 typedef u8 md5[16];
 
 typedef struct par_s par_t;